@@ -0,0 +1,513 @@
+// microbenchmarks for lfs. Given the lfs binary, it mounts a fresh image on a
+// temporary directory, runs each workload and prints one JSON document with
+// ops/s and p50/p99 latency per workload, then times remounts as the image
+// grows. Given a directory that is already mounted, it runs the same
+// workloads there and skips the mount timings. make bench builds it and
+// lfs_release, lfs without the sanitizers, and runs it on that; by hand:
+//   ./lfs_bench ./lfs_release [scale] [lfs options]
+//   ./lfs_bench ./lfs_release 4 dedup
+//   ./lfs_bench /mnt/lfs [scale]
+// Counts and sizes grow with scale and every random choice comes from a fixed
+// seed, so two builds run exactly the same operations.
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PATH_LEN 4096
+#define DEEP_PATH_DEPTH 32
+#define MOUNT_TIMEOUT 60
+#define MOUNT_RUNS 3
+
+struct workload {
+    const char *name;
+    double *lat;
+    size_t ops;
+    size_t cap;
+    size_t bytes;
+    double start;
+};
+
+char base[PATH_LEN + 16];
+char tmpdir[PATH_LEN];
+char mnt[PATH_LEN + 8];
+char *binary;
+const char *options;
+pid_t server = -1;
+unsigned long scale = 1;
+bool first = true;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// unmounts through fusermount and waits for the server to write its
+// checkpoint and exit
+void unmountLfs() {
+    if (server < 0) { return; }
+    pid_t pid = fork();
+    if (pid == 0) {
+        execlp("fusermount", "fusermount", "-u", mnt, (char *) NULL);
+        _exit(127);
+    }
+    if (pid > 0) { waitpid(pid, NULL, 0); }
+    waitpid(server, NULL, 0);
+    server = -1;
+}
+
+void fail(const char *what, const char *path) {
+    fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+    unmountLfs();
+    exit(1);
+}
+
+// starts lfs in the foreground inside the temporary directory, so it opens
+// the image there, and returns once the mount point has changed device
+double mountLfs() {
+    struct stat parent, st;
+    if (stat(tmpdir, &parent) != 0) { fail("stat", tmpdir); }
+    double start = now();
+    server = fork();
+    if (server < 0) { fail("fork", binary); }
+    if (server == 0) {
+        char log[PATH_LEN + 16];
+        snprintf(log, sizeof(log), "%s/lfs.log", tmpdir);
+        int fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd >= 0) { dup2(fd, 1); dup2(fd, 2); }
+        if (chdir(tmpdir) != 0) { _exit(127); }
+        if (options) { execl(binary, binary, "-f", "-o", options, mnt, (char *) NULL); }
+        else { execl(binary, binary, "-f", mnt, (char *) NULL); }
+        _exit(127);
+    }
+    while (now() - start < MOUNT_TIMEOUT) {
+        if (stat(mnt, &st) == 0 && st.st_dev != parent.st_dev) { return now() - start; }
+        if (waitpid(server, NULL, WNOHANG) == server) {
+            server = -1;
+            fprintf(stderr, "%s exited before mounting, see %s/lfs.log\n", binary, tmpdir);
+            exit(1);
+        }
+        usleep(1000);
+    }
+    fprintf(stderr, "%s did not mount within %d s\n", binary, MOUNT_TIMEOUT);
+    kill(server, SIGTERM);
+    unmountLfs();
+    exit(1);
+}
+
+// a fresh server has nothing cached, and unmounting drops the kernel's pages,
+// which keep_cache would otherwise keep past posix_fadvise. A directory
+// mounted by someone else cannot be remounted; false leaves the caller to
+// advise and the result to say the read was not cold
+bool remountLfs() {
+    if (!binary) { return false; }
+    unmountLfs();
+    mountLfs();
+    return true;
+}
+
+void begin(struct workload *w, const char *name, size_t cap) {
+    w->name = name;
+    w->lat = malloc(cap * sizeof(double));
+    if (!w->lat) { fail("malloc", name); }
+    w->ops = 0;
+    w->cap = cap;
+    w->bytes = 0;
+    w->start = now();
+}
+
+void tick(struct workload *w, double t0) {
+    if (w->ops < w->cap) { w->lat[w->ops] = now() - t0; }
+    ++w->ops;
+}
+
+int compareDouble(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+double percentile(double *sorted, size_t count, double p) {
+    if (count == 0) { return 0; }
+    size_t i = (size_t) (p * (count - 1) + 0.5);
+    return sorted[i];
+}
+
+// prints one result object; extra carries workload-specific fields
+void report(struct workload *w, const char *extra) {
+    double seconds = now() - w->start;
+    size_t count = (w->ops < w->cap) ? w->ops : w->cap;
+    qsort(w->lat, count, sizeof(double), compareDouble);
+    printf("%s\n    {\"name\": \"%s\", \"ops\": %zu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f",
+        (first) ? "" : ",", w->name, w->ops, seconds, (seconds > 0) ? w->ops / seconds : 0,
+        percentile(w->lat, count, 0.50) * 1e6, percentile(w->lat, count, 0.99) * 1e6);
+    if (w->bytes) { printf(", \"bytes\": %zu, \"mb_per_sec\": %.1f", w->bytes, (seconds > 0) ? w->bytes / seconds / 1e6 : 0); }
+    if (extra) { printf(", %s", extra); }
+    printf("}");
+    fflush(stdout);
+    first = false;
+    free(w->lat);
+}
+
+void makeDir(const char *path) {
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) { fail("mkdir", path); }
+}
+
+// readdir need not fill in d_type, so every entry is tried as a directory
+void removeTree(const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        if (errno != ENOTDIR) { fail("opendir", path); }
+        if (unlink(path) != 0) { fail("unlink", path); }
+        return;
+    }
+    struct dirent *de;
+    char child[PATH_LEN + 512];
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) { continue; }
+        snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+        removeTree(child);
+    }
+    closedir(dir);
+    if (rmdir(path) != 0) { fail("rmdir", path); }
+}
+
+// create, stat and unlink storms over one directory
+void metadata() {
+    size_t n = 2000 * scale, i;
+    char dir[PATH_LEN + 32], path[PATH_LEN + 64];
+    snprintf(dir, sizeof(dir), "%s/meta", base);
+    makeDir(dir);
+    struct workload w;
+    begin(&w, "create", n);
+    for (i = 0; i < n; ++i) {
+        snprintf(path, sizeof(path), "%s/f%zu", dir, i);
+        double t0 = now();
+        int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+        if (fd < 0) { fail("create", path); }
+        close(fd);
+        tick(&w, t0);
+    }
+    report(&w, NULL);
+    struct stat st;
+    begin(&w, "stat", n);
+    for (i = 0; i < n; ++i) {
+        snprintf(path, sizeof(path), "%s/f%zu", dir, i);
+        double t0 = now();
+        if (stat(path, &st) != 0) { fail("stat", path); }
+        tick(&w, t0);
+    }
+    report(&w, NULL);
+    begin(&w, "unlink", n);
+    for (i = 0; i < n; ++i) {
+        snprintf(path, sizeof(path), "%s/f%zu", dir, i);
+        double t0 = now();
+        if (unlink(path) != 0) { fail("unlink", path); }
+        tick(&w, t0);
+    }
+    report(&w, NULL);
+    if (rmdir(dir) != 0) { fail("rmdir", dir); }
+}
+
+// stats and opens a file DEEP_PATH_DEPTH directories down
+void deepLookup() {
+    size_t n = 2000 * scale, i;
+    char path[PATH_LEN + 256], extra[64];
+    int len = snprintf(path, sizeof(path), "%s", base);
+    for (i = 0; i < DEEP_PATH_DEPTH; ++i) {
+        len += snprintf(path + len, sizeof(path) - len, "/d%zu", i);
+        makeDir(path);
+    }
+    snprintf(path + len, sizeof(path) - len, "/leaf");
+    int fd = open(path, O_CREAT | O_WRONLY, 0644);
+    if (fd < 0) { fail("create", path); }
+    close(fd);
+    snprintf(extra, sizeof(extra), "\"depth\": %d", DEEP_PATH_DEPTH);
+    struct stat st;
+    struct workload w;
+    begin(&w, "deep_stat", n);
+    for (i = 0; i < n; ++i) {
+        double t0 = now();
+        if (stat(path, &st) != 0) { fail("stat", path); }
+        tick(&w, t0);
+    }
+    report(&w, extra);
+    begin(&w, "deep_open", n);
+    for (i = 0; i < n; ++i) {
+        double t0 = now();
+        if ((fd = open(path, O_RDONLY)) < 0) { fail("open", path); }
+        close(fd);
+        tick(&w, t0);
+    }
+    report(&w, extra);
+    snprintf(path, sizeof(path), "%s/d0", base);
+    removeTree(path);
+}
+
+// full listings of one large directory, one op per listing
+void largeReaddir() {
+    size_t n = 10000 * scale, passes = 20, i;
+    char dir[PATH_LEN + 32], path[PATH_LEN + 96], extra[64];
+    snprintf(dir, sizeof(dir), "%s/large", base);
+    makeDir(dir);
+    for (i = 0; i < n; ++i) {
+        snprintf(path, sizeof(path), "%s/entry-with-a-longer-name-%zu", dir, i);
+        int fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if (fd < 0) { fail("create", path); }
+        close(fd);
+    }
+    struct workload w;
+    begin(&w, "readdir_large", passes);
+    for (i = 0; i < passes; ++i) {
+        double t0 = now();
+        DIR *d = opendir(dir);
+        if (!d) { fail("opendir", dir); }
+        size_t seen = 0;
+        while (readdir(d) != NULL) { ++seen; }
+        closedir(d);
+        if (seen < n) { errno = ENOENT; fail("readdir", dir); }
+        tick(&w, t0);
+    }
+    snprintf(extra, sizeof(extra), "\"entries\": %zu", n);
+    report(&w, extra);
+    removeTree(dir);
+}
+
+// writes a file front to back in requests of size chunk, fsyncs it, then
+// reads it back from a fresh mount
+void sequential(size_t chunk, char *buf) {
+    size_t total = (size_t) 32 * scale << 20, done;
+    char path[PATH_LEN + 32], name[64], extra[64];
+    snprintf(path, sizeof(path), "%s/seq", base);
+    snprintf(extra, sizeof(extra), "\"request_bytes\": %zu", chunk);
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) { fail("create", path); }
+    struct workload w;
+    snprintf(name, sizeof(name), "seq_write_%zuk", chunk >> 10);
+    begin(&w, name, total / chunk);
+    for (done = 0; done < total; done += chunk) {
+        double t0 = now();
+        if (write(fd, buf, chunk) != (ssize_t) chunk) { fail("write", path); }
+        tick(&w, t0);
+    }
+    if (fsync(fd) != 0) { fail("fsync", path); }
+    close(fd);
+    w.bytes = total;
+    report(&w, extra);
+
+    bool cold = remountLfs();
+    if ((fd = open(path, O_RDONLY)) < 0) { fail("open", path); }
+    if (!cold) { posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED); }
+    snprintf(extra, sizeof(extra), "\"request_bytes\": %zu, \"cold\": %s", chunk, (cold) ? "true" : "false");
+    snprintf(name, sizeof(name), "seq_read_%zuk", chunk >> 10);
+    begin(&w, name, total / chunk);
+    for (done = 0; done < total; done += chunk) {
+        double t0 = now();
+        if (read(fd, buf, chunk) != (ssize_t) chunk) { fail("read", path); }
+        tick(&w, t0);
+    }
+    close(fd);
+    w.bytes = total;
+    report(&w, extra);
+    if (unlink(path) != 0) { fail("unlink", path); }
+}
+
+// aligned requests of size chunk at random offsets of a preallocated file
+void randomIO(size_t chunk, char *buf) {
+    size_t total = (size_t) 32 * scale << 20, n = 4000 * scale, i;
+    char path[PATH_LEN + 32], name[64], extra[64];
+    snprintf(path, sizeof(path), "%s/rand", base);
+    snprintf(extra, sizeof(extra), "\"request_bytes\": %zu", chunk);
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0) { fail("create", path); }
+    for (i = 0; i < total; i += chunk) {
+        if (write(fd, buf, chunk) != (ssize_t) chunk) { fail("write", path); }
+    }
+    if (fsync(fd) != 0) { fail("fsync", path); }
+    unsigned int seed = 42;
+    struct workload w;
+    snprintf(name, sizeof(name), "rand_write_%zuk", chunk >> 10);
+    begin(&w, name, n);
+    for (i = 0; i < n; ++i) {
+        off_t offset = (off_t) (rand_r(&seed) % (total / chunk)) * chunk;
+        double t0 = now();
+        if (pwrite(fd, buf, chunk, offset) != (ssize_t) chunk) { fail("pwrite", path); }
+        tick(&w, t0);
+    }
+    if (fsync(fd) != 0) { fail("fsync", path); }
+    w.bytes = n * chunk;
+    report(&w, extra);
+
+    close(fd);
+    bool cold = remountLfs();
+    if ((fd = open(path, O_RDONLY)) < 0) { fail("open", path); }
+    if (!cold) { posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED); }
+    snprintf(extra, sizeof(extra), "\"request_bytes\": %zu, \"cold\": %s", chunk, (cold) ? "true" : "false");
+    seed = 43;
+    snprintf(name, sizeof(name), "rand_read_%zuk", chunk >> 10);
+    begin(&w, name, n);
+    for (i = 0; i < n; ++i) {
+        off_t offset = (off_t) (rand_r(&seed) % (total / chunk)) * chunk;
+        double t0 = now();
+        if (pread(fd, buf, chunk, offset) != (ssize_t) chunk) { fail("pread", path); }
+        tick(&w, t0);
+    }
+    close(fd);
+    w.bytes = n * chunk;
+    report(&w, extra);
+    if (unlink(path) != 0) { fail("unlink", path); }
+}
+
+// renames files within one directory and back and forth between two
+void renames() {
+    size_t files = 100, n = 4000 * scale, i;
+    char a[PATH_LEN + 32], b[PATH_LEN + 32], from[PATH_LEN + 64], to[PATH_LEN + 64];
+    snprintf(a, sizeof(a), "%s/ra", base);
+    snprintf(b, sizeof(b), "%s/rb", base);
+    makeDir(a);
+    makeDir(b);
+    size_t *where = calloc(files, sizeof(size_t));
+    char *moved = calloc(files, 1);
+    if (!where || !moved) { fail("calloc", a); }
+    for (i = 0; i < files; ++i) {
+        snprintf(from, sizeof(from), "%s/f%zu.0", a, i);
+        int fd = open(from, O_CREAT | O_WRONLY, 0644);
+        if (fd < 0) { fail("create", from); }
+        close(fd);
+    }
+    unsigned int seed = 44;
+    struct workload w;
+    begin(&w, "rename_same_dir", n);
+    for (i = 0; i < n; ++i) {
+        size_t f = rand_r(&seed) % files;
+        snprintf(from, sizeof(from), "%s/f%zu.%zu", a, f, where[f]);
+        snprintf(to, sizeof(to), "%s/f%zu.%zu", a, f, where[f] + 1);
+        double t0 = now();
+        if (rename(from, to) != 0) { fail("rename", from); }
+        tick(&w, t0);
+        ++where[f];
+    }
+    report(&w, NULL);
+    begin(&w, "rename_cross_dir", n);
+    for (i = 0; i < n; ++i) {
+        size_t f = rand_r(&seed) % files;
+        snprintf(from, sizeof(from), "%s/f%zu.%zu", (moved[f]) ? b : a, f, where[f]);
+        snprintf(to, sizeof(to), "%s/f%zu.%zu", (moved[f]) ? a : b, f, where[f]);
+        double t0 = now();
+        if (rename(from, to) != 0) { fail("rename", from); }
+        tick(&w, t0);
+        moved[f] = !moved[f];
+    }
+    report(&w, NULL);
+    free(moved);
+    free(where);
+    removeTree(a);
+    removeTree(b);
+}
+
+// grows the image by the given amount of file data, then unmounts and times
+// MOUNT_RUNS mounts of it
+void mountTime(size_t grow, char *buf, size_t chunk) {
+    char path[PATH_LEN + 64], image[PATH_LEN + 16], extra[128];
+    if (grow) {
+        snprintf(path, sizeof(path), "%s/fill.%zu", base, grow);
+        int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if (fd < 0) { fail("create", path); }
+        size_t done;
+        for (done = 0; done < grow; done += chunk) {
+            if (write(fd, buf, chunk) != (ssize_t) chunk) { fail("write", path); }
+        }
+        close(fd);
+    }
+    unmountLfs();
+    struct stat st;
+    snprintf(image, sizeof(image), "%s/disk.img", tmpdir);
+    if (stat(image, &st) != 0) { fail("stat", image); }
+    struct workload w;
+    begin(&w, "mount", MOUNT_RUNS);
+    double elapsed = 0;
+    int i;
+    for (i = 0; i < MOUNT_RUNS; ++i) {
+        double took = mountLfs();
+        w.lat[w.ops++] = took;
+        elapsed += took;
+        if (i + 1 < MOUNT_RUNS) { unmountLfs(); }
+    }
+    // only the mounts themselves count, not the unmounts between them
+    w.start = now() - elapsed;
+    snprintf(extra, sizeof(extra), "\"image_bytes\": %lld", (long long) st.st_size);
+    report(&w, extra);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <lfs binary | mounted dir> [scale] [lfs options]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2) { scale = strtoul(argv[2], NULL, 10); }
+    if (scale == 0) { scale = 1; }
+    if (argc > 3 && argv[3][0]) { options = argv[3]; }
+    struct stat st;
+    if (stat(argv[1], &st) != 0) { fail("stat", argv[1]); }
+    if (S_ISDIR(st.st_mode)) {
+        snprintf(base, sizeof(base), "%s/bench.%d", argv[1], (int) getpid());
+    } else {
+        // lfs runs from the temporary directory, so a relative path would break
+        if (!(binary = realpath(argv[1], NULL))) { fail("realpath", argv[1]); }
+        const char *tmp = getenv("TMPDIR");
+        snprintf(tmpdir, sizeof(tmpdir), "%s/lfs-bench.XXXXXX", (tmp) ? tmp : "/tmp");
+        if (!mkdtemp(tmpdir)) { fail("mkdtemp", tmpdir); }
+        snprintf(mnt, sizeof(mnt), "%s/mnt", tmpdir);
+        makeDir(mnt);
+        mountLfs();
+        snprintf(base, sizeof(base), "%s/bench", mnt);
+    }
+    makeDir(base);
+
+    size_t max_chunk = 1 << 20, i;
+    char *buf = malloc(max_chunk);
+    if (!buf) { fail("malloc", base); }
+    // not one repeated byte, so nothing downstream can shortcut the data
+    unsigned int seed = 1;
+    for (i = 0; i < max_chunk; ++i) { buf[i] = rand_r(&seed); }
+
+    printf("{\"binary\": \"%s\", \"options\": \"%s\", \"scale\": %lu, \"results\": [",
+        (binary) ? binary : "", (options) ? options : "", scale);
+    metadata();
+    deepLookup();
+    largeReaddir();
+    sequential(4 << 10, buf);
+    sequential(64 << 10, buf);
+    sequential(1 << 20, buf);
+    randomIO(4 << 10, buf);
+    randomIO(64 << 10, buf);
+    renames();
+    if (binary) {
+        mountTime(0, buf, max_chunk);
+        mountTime((size_t) 64 * scale << 20, buf, max_chunk);
+        mountTime((size_t) 256 * scale << 20, buf, max_chunk);
+        unmountLfs();
+        char path[PATH_LEN + 16];
+        snprintf(path, sizeof(path), "%s/disk.img", tmpdir);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/lfs.log", tmpdir);
+        unlink(path);
+        rmdir(mnt);
+        rmdir(tmpdir);
+        free(binary);
+    } else {
+        removeTree(base);
+    }
+    printf("\n]}\n");
+    free(buf);
+    return 0;
+}
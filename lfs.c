@@ -1,14 +1,83 @@
 #include <fuse.h>
+#ifdef LFS_LOWLEVEL
+#include <fuse_lowlevel.h>
+#endif
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h> 
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the on-disk format is little-endian"
+#endif
 
 #define FILENAME_SIZE 256
+#define DISK_PATH "disk.img"
+#define SUPERBLOCK_SIZE 4096
+#define SEGMENT_SIZE (512 * 1024)
+#define LFS_MAGIC 0x31304c4f4753464cULL
+// bumped once per release that changes the on-disk layout; mount refuses
+// any other version
+#define LFS_VERSION 2
+#define ROOT_ID 0
+#define SEGMENT_MAGIC 0x4745534cU
+#define MAX_RECORD_PAYLOAD (SEGMENT_SIZE - sizeof(struct segment_header) - 2 * sizeof(struct record_header))
+#define MAX_CHECKPOINT_CHUNKS ((SUPERBLOCK_SIZE - sizeof(struct lfs_superblock)) / sizeof(u_int64_t))
+#define CLEAN_LOW_WATERMARK 4
+#define CLEAN_HIGH_WATERMARK 8
+#define CLEAN_MAX_UTILIZATION 0.9
+#define CLEAN_INTERVAL 1
+#define COMMIT_INTERVAL_MS 1000
+#define COMMIT_BYTES (256 * 1024)
+#define CHECKPOINT_INTERVAL 30
+// seconds; the path backend cannot tell the kernel of a directory size change,
+// see invalidateAttrs
+#ifdef LFS_LOWLEVEL
+#define CACHE_TIMEOUT 60
+#else
+#define CACHE_TIMEOUT 1
+#endif
+#define INDEX_MIN_SIZE 8
+#define DCACHE_SIZE 4096
+#define BLOCK_SIZE 4096
+#define BLOCKS_PER_TABLE 512
+#define STATS_XATTR "user.lfs.stats"
+#define EXTENTS_XATTR "user.lfs.extents"
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+#ifndef FALLOC_FL_ZERO_RANGE
+#define FALLOC_FL_ZERO_RANGE 0x10
+#endif
+#define INODES_PER_CHUNK 4096
+#define INODE_CHUNKS ((1U << 31) / INODES_PER_CHUNK)
+#define SLAB_PAGE_SIZE (64 * 1024)
+#define SLAB_MAP_WORDS (SLAB_PAGE_SIZE / 16 / 64)
+#define SLAB_HEADER_SIZE ((sizeof(struct slab_page) + 63) & ~(size_t) 63)
+#define SHARED_PER_PAGE 4096
+#define SHARED_PAGES ((1U << 31) / SHARED_PER_PAGE)
+#define COMPRESS_HASH_LOG 10
+#define COMPRESS_SAMPLES 4
+#define COMPRESS_MAX_ENTROPY 30
+#define CACHE_BLOCKS 1024
 
 int lfs_getattr( const char *, struct stat * );
+int lfs_opendir(const char *path, struct fuse_file_info *fi);
 int lfs_readdir( const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info * );
+int lfs_releasedir(const char *path, struct fuse_file_info *fi);
 int lfs_mknod(const char *path, mode_t mode, dev_t device);
 int lfs_mkdir(const char *path, mode_t mode);
 int lfs_unlink(const char *);
@@ -16,15 +85,25 @@ int lfs_rmdir(const char *path);
 int lfs_truncate(const char *path, off_t offset);
 int lfs_open( const char *, struct fuse_file_info * );
 int lfs_read( const char *, char *, size_t, off_t, struct fuse_file_info * );
+int lfs_read_buf(const char *, struct fuse_bufvec **, size_t, off_t, struct fuse_file_info *);
 int lfs_release(const char *path, struct fuse_file_info *fi);
 int lfs_write(const char *, const char *, size_t, off_t, struct fuse_file_info *);
+int lfs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi);
 int lfs_rename(const char *from, const char *to);
 int lfs_utime(const char *filename, struct utimbuf *times);
-struct LinkedListNode *findTokenInCurrent(struct LinkedListNode *current, char *token);
+int lfs_getxattr(const char *path, const char *name, char *value, size_t size);
+int lfs_flush(const char *path, struct fuse_file_info *fi);
+int lfs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+void *lfs_init(struct fuse_conn_info *conn);
+void lfs_destroy(void *private_data);
+struct LinkedListNode *findTokenInCurrent(struct LinkedListNode *current, const char *token);
 
+#ifndef LFS_LOWLEVEL
 static struct fuse_operations lfs_oper = {
     .getattr    = lfs_getattr,
+    .opendir    = lfs_opendir,
     .readdir    = lfs_readdir,
+    .releasedir = lfs_releasedir,
     .mkdir 	    = lfs_mkdir,
     .rmdir 	    = lfs_rmdir,
     .mknod      = lfs_mknod,
@@ -32,542 +111,4835 @@ static struct fuse_operations lfs_oper = {
     .truncate   = lfs_truncate,
     .open       = lfs_open,
     .read   	= lfs_read,
+    .read_buf   = lfs_read_buf,
     .release 	= lfs_release,
     .write 	    = lfs_write,
+    .fallocate  = lfs_fallocate,
     .rename 	= lfs_rename,
-    .utime      = lfs_utime
+    .utime      = lfs_utime,
+    .getxattr   = lfs_getxattr,
+    .flush      = lfs_flush,
+    .fsync      = lfs_fsync,
+    .fsyncdir   = lfs_fsync,
+    .init       = lfs_init,
+    .destroy    = lfs_destroy
 };
+#endif
 
+// the inode, stored at its id in the inode table. The fields getattr reads
+// come first and share a cache line with the lock. open_count also counts the
+// kernel's lookups under the low-level backend. data_changed is set by writes
+// and truncates and cleared by open, which lets the kernel keep its page
+// cache for a file that has not changed since it was last opened. With
+// compress, samples counts the blocks checked for entropy until the file is
+// trusted to compress or found incompressible. num_blocks counts the blocks
+// that are not holes, for st_blocks
 struct lfs_entry { 
-    char name[FILENAME_SIZE];
-    struct LinkedListNode *parent;
     size_t size;
-    bool isFile; 
-    char *contents;     
-    struct LinkedList *entries;
-    int id; 
+    size_t num_blocks;
     u_int64_t actime;
     u_int64_t modtime;
+    int id; 
+    u_int32_t generation;
+    int open_count;
+    bool isFile; 
+    bool unlinked;
+    bool live;
+    bool size_dirty;
+    bool data_changed;
+    bool incompressible;
+    u_int8_t samples;
+    pthread_rwlock_t lock;
+    struct LinkedListNode *parent;
+    struct LinkedList *entries;
+    struct block_table **tables;
+    size_t num_tables;
+    size_t tables_capacity;
 };
 
+// children stay in creation order on the list; index is an open-addressing
+// hash table over the same nodes, keyed by name. Every link hands the child
+// the next cookie, so cookies increase along the list and readdir can resume
+// after one; cursors are the open directories reading it, which a removal
+// steps back so they stay on the list
 struct LinkedList {
     struct LinkedListNode *head;
     struct LinkedListNode *tail;
     size_t num_entries;
+    struct LinkedListNode **index;
+    size_t index_size;
+    size_t index_used;
+    u_int64_t last_cookie;
+    struct dir_cursor *cursors;
+    pthread_rwlock_t lock;
+    bool loaded;
 };
 
+// a directory's handle on one of its children; name is interned, see
+// internName
 struct LinkedListNode {
     struct LinkedListNode *next;
     struct LinkedListNode *prev;
+    const char *name;
     struct lfs_entry *entry;
+    u_int64_t cookie;
+};
+
+// where readdir stopped on an open directory: the last child it returned, or
+// NULL once everything before the head was, and the offset that resumes after
+// it
+struct dir_cursor {
+    struct LinkedListNode *dir;
+    struct LinkedListNode *last;
+    off_t offset;
+    struct dir_cursor *next;
+    struct dir_cursor *prev;
+};
+
+// returns nonzero when the reply is full and name was not added
+typedef int (*dirent_fn)(void *ctx, const char *name, struct LinkedListNode *node, off_t next);
+
+// on-disk log: superblock, then fixed-size segments of appended records; all
+// fields are fixed width little-endian and every header carries a crc32
+enum record_type { RECORD_END = 0, RECORD_INODE, RECORD_DATA, RECORD_DELETE, RECORD_INDIRECT, RECORD_CHECKPOINT, RECORD_SHARED };
+// a compressed data or shared record holds its bytes in the LZ4 block format
+enum record_flags { RECORD_COMPRESSED = 1 };
+// kept in memory above the record flags of a block, never logged
+enum block_flags { BLOCK_REFERENCED = 0x4000, BLOCK_DIRTY = 0x8000, BLOCK_MEMORY_FLAGS = 0xc000 };
+
+// a checkpoint is the segment usage table, the inode map and the shared block
+// map, stored as
+// RECORD_CHECKPOINT chunks whose addresses follow the superblock. It is written
+// periodically and on unmount; mount loads it and rolls forward the records
+// appended after tail, which all have a seq of at least record_seq.
+// next_generation is refreshed on every superblock write
+struct lfs_superblock {
+    u_int64_t magic;
+    u_int32_t version;
+    u_int32_t segment_size;
+    u_int32_t num_segments;
+    u_int32_t block_size;
+    u_int32_t crc;
+    u_int32_t num_chunks;
+    u_int64_t segment_seq;
+    u_int64_t record_seq;
+    u_int64_t tail;
+    u_int64_t imap_size;
+    u_int64_t shared_size;
+    u_int32_t current_segment;
+    int32_t next_id;
+    u_int32_t checkpoint_segments;
+    u_int32_t next_generation;
+};
+
+struct checkpoint_entry {
+    u_int64_t addr;
+    u_int32_t len;
+    u_int32_t records;
+    int64_t parent;
+    u_int64_t size;
+    u_int32_t type;
+    u_int32_t is_file;
+    u_int32_t generation;
+    u_int32_t reserved;
+};
+
+struct shared_entry {
+    u_int64_t addr;
+    u_int64_t hash;
+    u_int16_t len;
+    u_int16_t flags;
+    u_int32_t refs;
+};
+
+struct segment_header {
+    u_int32_t magic;
+    u_int32_t mtime;
+    u_int64_t seq;
+    u_int32_t crc;
+    u_int32_t reserved;
+};
+
+// crc covers the header with crc == 0 followed by the payload
+struct record_header {
+    u_int32_t type;
+    u_int32_t length;
+    u_int64_t seq;
+    int64_t id;
+    u_int32_t crc;
+    u_int32_t flags;
+};
+
+// payload of RECORD_INODE, followed by the name and the addresses of the
+// file's indirect tables (0 for a table with no blocks)
+struct inode_record {
+    int64_t parent;
+    u_int64_t size;
+    u_int64_t actime;
+    u_int64_t modtime;
+    u_int32_t isFile;
+    u_int32_t name_len;
+    u_int32_t num_tables;
+    u_int32_t generation;
+};
+
+// payload of RECORD_INDIRECT, followed by count block pointers
+struct indirect_record {
+    u_int32_t index;
+    u_int32_t count;
+};
+
+// a nonzero shared names a block of the shared store, addr and len are 0 then;
+// flags are those of the data record
+struct block_pointer {
+    u_int64_t addr;
+    u_int16_t len;
+    u_int16_t flags;
+    u_int32_t shared;
+};
+
+// payload of RECORD_DATA, followed by the block's bytes up to end of file;
+// RECORD_SHARED has the shared id in block and is not owned by an inode
+struct data_record {
+    u_int64_t block;
+};
+
+// file contents are fixed-size blocks; data == NULL && addr == 0 is a hole,
+// data == NULL with an address is a cold block only stored in the log. A
+// block with a shared id has neither, its contents are the shared block's.
+// A data record is at most a block long, so len fits 16 bits. A dirty block
+// holds data its record does not have yet
+struct lfs_block {
+    char *data;
+    off_t addr;
+    u_int16_t len;
+    u_int16_t flags;
+    u_int32_t shared;
+};
+
+// one indirect table, maps BLOCKS_PER_TABLE consecutive blocks
+struct block_table {
+    struct lfs_block blocks[BLOCKS_PER_TABLE];
+    off_t addr;
+    u_int32_t len;
+    bool dirty;
+};
+
+// with dedup, logged blocks are handed to the shared store, which keeps one
+// RECORD_SHARED per distinct contents and counts the blocks referring to it.
+// Referrers name it by id, so the cleaner moves it without touching them.
+// Ids start at 1, live ones are chained by hash in buckets. A dropped id is
+// held back on released until the next checkpoint, so no older table the
+// log could still roll forward to names it while it is reused
+struct shared_block {
+    struct lfs_block block;
+    u_int64_t hash;
+    u_int32_t refs;
+    u_int32_t next;
+};
+
+struct shared_page {
+    struct shared_block blocks[SHARED_PER_PAGE];
+};
+
+struct shared_store {
+    struct shared_page *pages[SHARED_PAGES];
+    u_int32_t size;
+    u_int32_t *buckets;
+    size_t num_buckets;
+    size_t count;
+    u_int32_t free;
+    u_int32_t released;
+    u_int64_t references;
+    u_int64_t stored_bytes;
+    u_int64_t referenced_bytes;
+    u_int64_t hits;
+};
+
+// decompressed copies of cold compressed blocks, by record address. Slots
+// start at 1, are chained by address hash and kept on a list from the most to
+// the least recently used; a copy whose segment is reused is dropped
+struct cached_block {
+    off_t addr;
+    char *data;
+    u_int32_t next;
+    u_int32_t newer;
+    u_int32_t older;
+};
+
+struct block_cache {
+    struct cached_block *slots;
+    u_int32_t *buckets;
+    u_int32_t num_slots;
+    u_int32_t num_buckets;
+    u_int32_t used;
+    u_int32_t newest;
+    u_int32_t oldest;
+    u_int64_t hits;
+    u_int64_t misses;
+    pthread_mutex_t lock;
+};
+
+// block buffers held in memory, counted against mem_budget, and the next
+// inode and shared id the eviction sweep looks at
+struct lfs_memory {
+    u_int64_t resident;
+    u_int64_t evictions;
+    u_int64_t faults;
+    int file_hand;
+    u_int32_t shared_hand;
+};
+
+// blocks logged with compress, guarded by log_lock. raw_bytes are what the
+// compressed ones hold and stored_bytes what they take in the log
+struct compress_stats {
+    u_int64_t compressed;
+    u_int64_t uncompressed;
+    u_int64_t raw_bytes;
+    u_int64_t stored_bytes;
+    u_int64_t opted_out;
+};
+
+// a held segment has been cleaned but may still hold the state the last
+// checkpoint names, which rolling forward subtracts; it is free once the next
+// checkpoint is written and never appears in one
+enum segment_state { SEGMENT_FREE = 0, SEGMENT_ACTIVE, SEGMENT_DIRTY, SEGMENT_CLEANING, SEGMENT_HELD };
+
+struct segment_usage {
+    u_int32_t live_bytes;
+    u_int32_t state;
+    u_int64_t mtime;
+};
+
+struct lfs_log {
+    int fd;
+    u_int32_t num_segments;
+    u_int32_t current_segment;
+    off_t tail;
+    u_int64_t segment_seq;
+    u_int64_t record_seq;
+    struct segment_usage *usage;
+    u_int32_t free_segments;
+    u_int32_t held_segments;
+    char *wbuf;
+    off_t flushed;
+    off_t synced;
+    struct lfs_superblock checkpoint;
+    u_int64_t chunks[MAX_CHECKPOINT_CHUNKS];
+    u_int32_t chunk_len[MAX_CHECKPOINT_CHUNKS];
+    u_int64_t checkpoint_time;
+};
+
+// addr/len locate the live inode record, or the tombstone when type is
+// RECORD_DELETE; records counts every record of the id still stored in a
+// non-free segment. After a checkpoint mount node stays NULL until the parent
+// directory is first read, parent/size describe the entry until then and
+// first_child/next_sibling chain the children still to load (0 ends a chain,
+// the root is never a child)
+struct imap_entry {
+    off_t addr;
+    u_int32_t len;
+    u_int32_t records;
+    u_int32_t type;
+    struct LinkedListNode *node;
+    int64_t parent;
+    u_int64_t size;
+    bool is_file;
+    u_int32_t generation;
+    int first_child;
+    int next_sibling;
+};
+
+struct lfs_config {
+    unsigned int clean_low;
+    unsigned int clean_high;
+    unsigned int dcache_size;
+    unsigned int durable;
+    unsigned int commit_interval;
+    unsigned int commit_bytes;
+    unsigned int checkpoint_interval;
+    unsigned int cache_timeout;
+    unsigned int dedup;
+    unsigned int compress;
+    unsigned int cache_blocks;
+    unsigned int mem_budget;
+};
+
+// full path to node, node == NULL caches ENOENT; direct mapped by path hash
+struct dcache_entry {
+    char *path;
+    size_t hash;
+    struct LinkedListNode *node;
+};
 
+// generation moves on every invalidation so a lookup that raced with one
+// does not store its stale result
+struct lfs_dcache {
+    struct dcache_entry *slots;
+    size_t size;
+    pthread_mutex_t lock;
+    u_int64_t generation;
+    u_int64_t hits;
+    u_int64_t negative_hits;
+    u_int64_t misses;
+    u_int64_t invalidations;
+};
+
+struct lfs_cleaner {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool running;
+    bool stop;
+    bool active;
+};
+
+struct lfs_flusher {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool running;
+    bool stop;
+};
+
+// a shared block copied out of a victim, repointed once readers of the old
+// copy are done
+struct moved_shared {
+    u_int32_t id;
+    u_int32_t len;
+    off_t from;
+    off_t to;
+};
+
+struct dirty_list {
+    int *ids;
+    size_t count;
+    size_t capacity;
+    bool checkpoint;
+    struct moved_shared *moved;
+    size_t num_moved;
+    size_t moved_capacity;
+};
+
+// a slab hands out objects of one size from SLAB_PAGE_SIZE aligned pages, so
+// an object's page is found by masking its address. map marks the slots in
+// use, pages with a free slot are also on the partial list
+struct slab_page {
+    struct slab_page *next;
+    struct slab_page *prev;
+    struct slab_page *next_partial;
+    struct slab_page *prev_partial;
+    size_t used;
+    u_int64_t map[SLAB_MAP_WORDS];
+};
+
+struct lfs_slab {
+    const char *name;
+    size_t size;
+    pthread_mutex_t lock;
+    struct slab_page *pages;
+    struct slab_page *partial;
+    size_t num_pages;
+    size_t objects;
+};
+
+// chunks are allocated as ids first land in them and freed once empty, so
+// an entry never moves and chunks[] is only read under lock; chunks past
+// num_chunks were never allocated
+struct inode_chunk {
+    size_t live;
+    struct lfs_entry inodes[INODES_PER_CHUNK];
 };
 
+struct inode_table {
+    struct inode_chunk *chunks[INODE_CHUNKS];
+    size_t num_chunks;
+    size_t allocated;
+    size_t live;
+    pthread_mutex_t lock;
+};
+
+// ids below CURRENT_ID whose inode is gone are set in free and handed out
+// again lowest first, hint is the first word that may have one. generation
+// is the next one to give out; an inode number is its generation and id
+struct id_allocator {
+    u_int64_t *free;
+    size_t words;
+    size_t hint;
+    u_int32_t generation;
+    pthread_mutex_t lock;
+};
+
+enum slab_class { SLAB_NODE = 0, SLAB_LIST, SLAB_NAME_32, SLAB_NAME_64, SLAB_NAME_128, SLAB_NAME_288, NUM_SLABS };
+
+// an interned name, shared by every entry with that name and allocated from
+// the smallest name slab it fits in
+struct lfs_name {
+    struct lfs_name *next;
+    size_t hash;
+    u_int32_t refs;
+    char str[];
+};
+
+struct name_table {
+    struct lfs_name **buckets;
+    size_t size;
+    size_t count;
+    pthread_mutex_t lock;
+};
+
+int loadDirectory(struct LinkedListNode *dir);
+int readBlock(struct lfs_block *block);
+int readStored(off_t addr, char *buf);
+struct lfs_block *storedBlock(struct lfs_block *block);
+int unshareBlock(struct lfs_block *block, bool copy);
+void dropShared(u_int32_t id);
+void releaseShared(struct lfs_entry *entry);
+
 // global variables 
+// locking: every callback holds tree_lock shared, only those freeing nodes
+// (unlink, rmdir, rename) take it exclusive. Under it a directory's entry
+// list is guarded by its own rwlock and an entry's size, blocks and times by
+// the entry's rwlock, except that a directory's size is refreshed under its
+// list's lock. log_lock serializes the appender, the imap and the shared
+// store and is only ever followed by cache.lock.
+// commits: with durable every mutating callback writes its records through
+// and syncs before returning. Otherwise records are buffered in wbuf, which
+// mirrors the current segment past flushed, and the flusher writes them back
+// and syncs every commit_interval ms, once commit_bytes are pending, or on
+// fsync.
+pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;
 struct LinkedListNode *root;
 int CURRENT_ID = 0;
+struct lfs_log disk_log = { .fd = -1 };
+u_int32_t crc_table[256];
+struct imap_entry *imap = NULL;
+size_t imap_size = 0;
+pthread_mutex_t log_lock;
+struct lfs_config config = { CLEAN_LOW_WATERMARK, CLEAN_HIGH_WATERMARK, DCACHE_SIZE, 0, COMMIT_INTERVAL_MS, COMMIT_BYTES, CHECKPOINT_INTERVAL, CACHE_TIMEOUT, 0, 0, CACHE_BLOCKS, 0 };
+struct lfs_dcache dcache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+struct lfs_cleaner cleaner = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+struct lfs_flusher flusher = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+struct lfs_slab slabs[NUM_SLABS] = {
+    { "node", sizeof(struct LinkedListNode), PTHREAD_MUTEX_INITIALIZER },
+    { "list", sizeof(struct LinkedList), PTHREAD_MUTEX_INITIALIZER },
+    { "name32", 32, PTHREAD_MUTEX_INITIALIZER },
+    { "name64", 64, PTHREAD_MUTEX_INITIALIZER },
+    { "name128", 128, PTHREAD_MUTEX_INITIALIZER },
+    { "name288", 288, PTHREAD_MUTEX_INITIALIZER }
+};
+struct name_table names = { .lock = PTHREAD_MUTEX_INITIALIZER };
+struct inode_table inodes = { .lock = PTHREAD_MUTEX_INITIALIZER };
+struct id_allocator ids = { .lock = PTHREAD_MUTEX_INITIALIZER };
+struct shared_store shared;
+struct block_cache cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+struct compress_stats compression;
+struct lfs_memory memory;
+#ifdef LFS_LOWLEVEL
+struct fuse_chan *notify_chan;
+#endif
+
+#define LFS_OPT(t, p) { t, offsetof(struct lfs_config, p), 1 }
+static const struct fuse_opt lfs_opts[] = {
+    LFS_OPT("clean_low=%u", clean_low),
+    LFS_OPT("clean_high=%u", clean_high),
+    LFS_OPT("dcache_size=%u", dcache_size),
+    LFS_OPT("durable", durable),
+    LFS_OPT("commit_interval=%u", commit_interval),
+    LFS_OPT("commit_bytes=%u", commit_bytes),
+    LFS_OPT("checkpoint_interval=%u", checkpoint_interval),
+    LFS_OPT("cache_timeout=%u", cache_timeout),
+    LFS_OPT("dedup", dedup),
+    LFS_OPT("compress", compress),
+    LFS_OPT("cache_blocks=%u", cache_blocks),
+    LFS_OPT("mem_budget=%u", mem_budget),
+    FUSE_OPT_END
+};
 
 // auxiliary methods
-int generateId() { return CURRENT_ID++; }
+// returns -ENOSPC once no id is free and the counter has reached INT_MAX
+int generateId() {
+    pthread_mutex_lock(&ids.lock);
+    while (ids.hint < ids.words && !ids.free[ids.hint]) { ++ids.hint; }
+    int id;
+    if (ids.hint < ids.words) {
+        int bit = __builtin_ctzll(ids.free[ids.hint]);
+        ids.free[ids.hint] &= ~(1ULL << bit);
+        id = ids.hint * 64 + bit;
+    } else if (CURRENT_ID == INT_MAX) { id = -ENOSPC; }
+    else { id = CURRENT_ID++; }
+    pthread_mutex_unlock(&ids.lock);
+    return id;
+}
 
-int saveAux(struct LinkedListNode *node, FILE *fp, char *savePath){
-    if (node == NULL) { return 0; }
-    size_t len;
-    if (node != root) { len = strlen(savePath) + strlen(node->entry->name) + 2; }
-    else { len = strlen(savePath) + strlen(node->entry->name) + 1; }
-    char *current_savePath = malloc(len);
-    if (!current_savePath) { return -EFAULT; }
-    strncpy(current_savePath, savePath, len);
-    strcat(current_savePath, node->entry->name);
-    if (node != root) { current_savePath = strcat(current_savePath, "/"); }
-    fprintf(fp, "|");
-    fprintf(fp, "%s|" , current_savePath);
-    fprintf(fp, "%d|", node->entry->isFile);
-    fprintf(fp, "%d|", node->entry->id);
-    fprintf(fp, "%ld|", node->entry->size);
-    fprintf(fp, "%ld|", node->entry->modtime);
-    fprintf(fp, "%ld|", node->entry->actime);
-    if (node->entry->isFile && node->entry->contents != NULL) { fprintf(fp, "%s", node->entry->contents); }
-    if (!node->entry->isFile && node->entry->entries) {
-        if (node->entry->entries->head != NULL) {
-            struct LinkedListNode *child = node->entry->entries->head;
-            while (child != NULL) {
-                saveAux(child, fp, current_savePath);
-                child = child->next;
-            }
+int releaseId(int id) {
+    size_t word = (size_t) id / 64;
+    pthread_mutex_lock(&ids.lock);
+    if (word >= ids.words) {
+        size_t words = (ids.words) ? ids.words : 16;
+        while (words <= word) { words *= 2; }
+        u_int64_t *tmp = realloc(ids.free, words * sizeof(u_int64_t));
+        if (!tmp) {
+            pthread_mutex_unlock(&ids.lock);
+            return -EFAULT;
         }
+        memset(tmp + ids.words, 0, (words - ids.words) * sizeof(u_int64_t));
+        ids.free = tmp;
+        ids.words = words;
     }
-    free(current_savePath);
+    ids.free[word] |= 1ULL << (id % 64);
+    if (word < ids.hint) { ids.hint = word; }
+    pthread_mutex_unlock(&ids.lock);
     return 0;
 }
 
-int saveTree(struct LinkedListNode *root){
-    char *savePath = "";
-    FILE *fp = fopen("disk.img", "wb");
-    if (!fp) { return errno; }
-    int res;
-    if ((res = saveAux(root, fp, savePath)) != 0) {
-        fclose(fp);
-        return res;
-    }
-    fprintf(fp, "|");
-    fclose(fp);
+// generations never wrap, an inode number would come back for another file;
+// once UINT32_MAX is reached no more inodes are made
+int nextGeneration(u_int32_t *generation) {
+    u_int32_t current = __atomic_load_n(&ids.generation, __ATOMIC_RELAXED);
+    do {
+        if (current == UINT32_MAX) { return -ENOSPC; }
+    } while (!__atomic_compare_exchange_n(&ids.generation, &current, current + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    *generation = current;
     return 0;
 }
 
-struct LinkedListNode *findEntry(const char *path) {
-    if (strcmp(path, "/") == 0) { return root; }
-    struct LinkedListNode *current = root;
-    size_t len = strlen(path) + 1;
-    char *current_path = malloc(len);
-    if (!current_path) { return NULL; }
-    strncpy(current_path, path, len);
-    current_path[len-1] = '\0';
-    char *token = strtok(current_path, "/");
-    while (token != NULL) {
-        current = findTokenInCurrent(current, token);
-        token = strtok(NULL, "/");
-    }
-    free(current_path);
-    return current;
+// mount only ever raises the counter past the generations it finds
+void seenGeneration(u_int32_t generation) {
+    if (generation >= ids.generation) { ids.generation = (generation == UINT32_MAX) ? UINT32_MAX : generation + 1; }
 }
 
-struct LinkedListNode *findTokenInCurrent(struct LinkedListNode *current, char *token) {
-    current = current->entry->entries->head;
-    if (current == NULL) { return NULL; }
-    while (current != NULL && strcmp(current->entry->name, token) != 0) {
-        current = current->next;
+void initChecksum() {
+    u_int32_t i, j;
+    for (i = 0; i < 256; ++i) {
+        u_int32_t crc = i;
+        for (j = 0; j < 8; ++j) { crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320U : crc >> 1; }
+        crc_table[i] = crc;
     }
-    return current;
-}	
+}
 
-int makeEntry(const char *path, bool isFile) {
-    size_t len = strlen(path) + 1;
-    char *current_path = malloc(len);
-    if (!current_path) { return -EFAULT; }
-    strncpy(current_path, path, len);
-    bool seekOp = true;
-    struct LinkedListNode *current = root;
-    char tmp[FILENAME_SIZE];
-    struct LinkedListNode *parent;
-    char *token = strtok(current_path, "/");
+u_int32_t checksum(u_int32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    crc = ~crc;
+    while (len--) { crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8); }
+    return ~crc;
+}
 
-    while (token != NULL) {
-        size_t len = strlen(token) + 1;
-        len = (len < FILENAME_SIZE) ? len : FILENAME_SIZE;
-        strncpy(tmp, token, len);
-        parent = current;
-        if (!(current = findTokenInCurrent(current, token))) {
-            seekOp = false;
-            token = strtok(NULL, "/");
-            break;
-        } 
-        token = strtok(NULL, "/");
-    }
-    if (!seekOp && token == NULL) {
-        struct LinkedListNode *new_node = malloc(sizeof(struct LinkedListNode));
-        if (!new_node) { 
-            free(current_path);
-            return -EFAULT; 
-        }
-        new_node->entry = malloc(sizeof(struct lfs_entry));
-        if (!new_node->entry) {
-            free(current_path);
-            free(new_node);
-            return -EFAULT; 
-        }
-        strcpy(new_node->entry->name, tmp);
-        new_node->entry->size = 0;
-        new_node->entry->isFile = isFile;
-        new_node->entry->actime = time(NULL);
-        new_node->entry->modtime = time(NULL);
-        new_node->entry->id = generateId();
-        new_node->entry->parent = parent;
-        if (!isFile) {
-            new_node->entry->entries = malloc(sizeof(struct LinkedList));
-            if (new_node->entry->entries == NULL)  { 
-                free(current_path);
-                free(new_node->entry);
-                free(new_node);
-                return -EFAULT;
-            }
-            new_node->entry->entries->head = NULL;
-            new_node->entry->entries->tail = NULL;
-            new_node->entry->entries->num_entries = 0;
-        } else { new_node->entry->contents = NULL; }
-        new_node->next = NULL;
-        new_node->prev = parent->entry->entries->tail;
-        if (new_node->prev) { new_node->prev->next = new_node; }
-        parent->entry->entries->tail = new_node;
-        if (!parent->entry->entries->head) { parent->entry->entries->head = new_node; }
-        ++parent->entry->entries->num_entries;
-    } else {
-        free(current_path);
-        return -EEXIST;
-    }
-    free(current_path);
-    return 0;
+// compression methods. Blocks are stored in the LZ4 block format: sequences
+// of a token holding the literal and match lengths, the literals, a 2 byte
+// match offset and the length extensions. No match starts in the last 12
+// bytes and the last 5 are always literals, as the format requires
+u_int32_t readWord(const unsigned char *p) {
+    u_int32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
 }
 
-void updateDirSizesToRoot(struct LinkedListNode *parent, size_t size) {
-    while (parent != NULL) {
-        parent->entry->size += size;
-        parent = parent->entry->parent;
-    }
+// a length nibble of 15 continues in bytes of 255 up to a smaller one
+size_t putLength(unsigned char *dst, size_t length) {
+    size_t n = 0;
+    for (; length >= 255; length -= 255) { dst[n++] = 255; }
+    dst[n++] = length;
+    return n;
 }
 
-void updateChildrenToParent(struct LinkedListNode *new_node) {
-    struct LinkedListNode *child = new_node->entry->entries->head;
-    while (child != NULL) {
-        child->entry->parent = new_node;
-        child = child->next;
+// adds the extension at pos to *length, returns the position past it or 0
+// when the input ends first
+size_t getLength(const unsigned char *src, size_t len, size_t pos, size_t *length) {
+    unsigned char byte;
+    do {
+        if (pos >= len) { return 0; }
+        byte = src[pos++];
+        *length += byte;
+    } while (byte == 255);
+    return pos;
+}
+
+// returns the compressed length, or 0 when it would not stay below capacity
+size_t compressBlock(const char *src, size_t len, char *dst, size_t capacity) {
+    const unsigned char *in = (const unsigned char *) src;
+    unsigned char *out = (unsigned char *) dst;
+    u_int16_t table[1 << COMPRESS_HASH_LOG];
+    memset(table, 0, sizeof(table));
+    size_t pos = 0, anchor = 0, done = 0, literals;
+    while (pos + 12 < len) {
+        u_int32_t word = readWord(in + pos);
+        u_int32_t hash = (word * 2654435761U) >> (32 - COMPRESS_HASH_LOG);
+        size_t candidate = table[hash];
+        table[hash] = pos;
+        if (candidate >= pos || readWord(in + candidate) != word) {
+            ++pos;
+            continue;
+        }
+        size_t match = 4;
+        while (pos + match + 5 < len && in[candidate + match] == in[pos + match]) { ++match; }
+        literals = pos - anchor;
+        if (done + 1 + literals / 255 + 1 + literals + 2 + (match - 4) / 255 + 1 >= capacity) { return 0; }
+        out[done++] = ((literals < 15) ? literals : 15) << 4 | ((match - 4 < 15) ? match - 4 : 15);
+        if (literals >= 15) { done += putLength(out + done, literals - 15); }
+        memcpy(out + done, in + anchor, literals);
+        done += literals;
+        out[done++] = (pos - candidate) & 0xff;
+        out[done++] = (pos - candidate) >> 8;
+        if (match - 4 >= 15) { done += putLength(out + done, match - 4 - 15); }
+        pos += match;
+        anchor = pos;
     }
+    literals = len - anchor;
+    if (done + 1 + literals / 255 + 1 + literals >= capacity) { return 0; }
+    out[done++] = ((literals < 15) ? literals : 15) << 4;
+    if (literals >= 15) { done += putLength(out + done, literals - 15); }
+    memcpy(out + done, in + anchor, literals);
+    return done + literals;
 }
 
-int removeEntry(struct LinkedListNode *current) {
-    if (!current) { return -ENOENT; }
-    if (!current->entry->isFile && current->entry->entries != NULL && current->entry->entries->num_entries != 0) {
-        return -ENOTEMPTY; 
-    } 
-    struct LinkedListNode *parent = current->entry->parent;
-    if (parent->entry->entries->head == current && parent->entry->entries->tail == current) { 
-        parent->entry->entries->head = NULL;
-        parent->entry->entries->tail = NULL;
-    } else if (current == parent->entry->entries->head) { 
-        parent->entry->entries->head = current->next;
-        current->next->prev = NULL;
-    } else if (current == parent->entry->entries->tail) { 
-        parent->entry->entries->tail = current->prev;
-        current->prev->next = NULL;
-    } else {
-        current->prev->next = current->next;
-        current->next->prev = current->prev;
+// returns the decompressed length, -EIO when src is not a block that fits
+// capacity
+int decompressBlock(const char *src, size_t len, char *dst, size_t capacity) {
+    const unsigned char *in = (const unsigned char *) src;
+    size_t pos = 0, done = 0;
+    while (pos < len) {
+        unsigned char token = in[pos++];
+        size_t literals = token >> 4, match = (token & 15) + 4;
+        if (literals == 15 && (pos = getLength(in, len, pos, &literals)) == 0) { return -EIO; }
+        if (literals > len - pos || literals > capacity - done) { return -EIO; }
+        memcpy(dst + done, in + pos, literals);
+        pos += literals;
+        done += literals;
+        if (pos == len) { break; }
+        if (len - pos < 2) { return -EIO; }
+        size_t offset = in[pos] | in[pos + 1] << 8;
+        pos += 2;
+        if ((token & 15) == 15 && (pos = getLength(in, len, pos, &match)) == 0) { return -EIO; }
+        if (offset == 0 || offset > done || match > capacity - done) { return -EIO; }
+        for (; match > 0; --match, ++done) { dst[done] = dst[done - offset]; }
     }
-    --parent->entry->entries->num_entries;
-    return 0;
+    return done;
 }
 
-int rmThisEntry(struct LinkedListNode *current) {
-    int result = removeEntry(current);
-    if (result < 0) { return result; }
-    updateDirSizesToRoot(current->entry->parent, -current->entry->size); // maybe move this above the if ???????
+// log2(x) in quarter bits, rounded down
+u_int32_t quarterLog(u_int64_t x) { return 63 - __builtin_clzll(x * x * x * x); }
 
-    if (!current->entry->isFile) { 
-        free(current->entry->entries->head);
-        free(current->entry->entries->tail);
-        free(current->entry->entries);
-    } else { free(current->entry->contents); }
-    free(current->entry);
-    free(current);
-    return 0;
+// Shannon entropy of the block's byte histogram in quarter bits per byte;
+// already compressed or encrypted data comes close to 32
+u_int32_t blockEntropy(const char *data, size_t len) {
+    if (len == 0) { return 0; }
+    u_int32_t counts[256];
+    memset(counts, 0, sizeof(counts));
+    size_t i;
+    for (i = 0; i < len; ++i) { ++counts[(unsigned char) data[i]]; }
+    u_int64_t sum = 0;
+    for (i = 0; i < 256; ++i) {
+        if (counts[i]) { sum += (u_int64_t) counts[i] * (quarterLog(len) - quarterLog(counts[i])); }
+    }
+    return sum / len;
 }
 
-void dfsDelete(struct LinkedListNode* node) {
-    if (node == NULL) { return; }
-    struct LinkedListNode *next = NULL;
-    while (node != NULL) {
-        next = node->next;
-        if (node == root) {
-            dfsDelete(node->entry->entries->head);
-            free(root->entry->entries);
-            free(root->entry);
-            free(root);
-            return;
+// copies a block's bytes into a record payload, compressed when compress is
+// on, the file has not opted out and it saves an eighth; sets the record's
+// flags and returns the payload bytes. The first COMPRESS_SAMPLES blocks a
+// file logs are sampled, one that looks random opts the file out
+size_t packBlock(struct lfs_entry *entry, const char *data, size_t length, char *payload, u_int32_t *flags) {
+    *flags = 0;
+    if (!config.compress || length == 0) {
+        memcpy(payload, data, length);
+        return length;
+    }
+    if (!entry->incompressible && entry->samples < COMPRESS_SAMPLES) {
+        ++entry->samples;
+        if (blockEntropy(data, length) > COMPRESS_MAX_ENTROPY) {
+            entry->incompressible = true;
+            ++compression.opted_out;
         }
-        if (!node->entry->isFile) { dfsDelete(node->entry->entries->head); }
-        rmThisEntry(node);
-        node = next;
     }
+    size_t packed = (entry->incompressible) ? 0 : compressBlock(data, length, payload, length - length / 8);
+    if (packed == 0) {
+        ++compression.uncompressed;
+        memcpy(payload, data, length);
+        return length;
+    }
+    *flags = RECORD_COMPRESSED;
+    ++compression.compressed;
+    compression.raw_bytes += length;
+    compression.stored_bytes += packed;
+    return packed;
 }
 
-int loadFromDisk() {
-    FILE *fp;
-    if (!(fp = fopen("disk.img", "rb"))) { return -1; }
-    fseek(fp, 0, SEEK_END);
-    int filesize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    char fBuf[filesize+1];
-    if (fread(fBuf, 1, filesize, fp) != (size_t) filesize) {
-        fclose(fp);
-        return -EIO;
-    }
-    fclose(fp);
-    fBuf[filesize] = '\0';
-    struct LinkedListNode *current = NULL;
-    char *path = NULL;
-    bool isFile = false;
-    int id = 0;
-    size_t size = 0;
-    u_int64_t actime = time(NULL);
-    u_int64_t modtime = time(NULL);
-    char *contents = NULL;
+// slab methods
+size_t slabPerPage(struct lfs_slab *slab) { return (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE) / slab->size; }
 
-    int oldPipe = 0;
-    int tokenType = 0;
-    int i = 0;
-    for (i = 2; i < filesize; ++i) {
-        if (fBuf[i] == '|' || i+1 == filesize) {
-            char temp[i-oldPipe];
-            ++tokenType;
-            switch (tokenType) {
-                case 1:
-                    path = malloc(i - oldPipe);
-                    if (!path) { return -EFAULT; }
-                    strncpy(path, &fBuf[oldPipe+1], (size_t) (i-oldPipe-1));
-                    path[i-oldPipe-1] = '\0';
-                    break;
-                case 2:
-                    isFile = (fBuf[i-1] == '1');
-                    break;
-                case 3:
-                    strncpy(temp, &fBuf[oldPipe+1], (size_t) (i-oldPipe-1));
-                    temp[i-oldPipe-1] = '\0';
-                    id = atoi(temp);
-                    break;
-                case 4:
-                    strncpy(temp, &fBuf[oldPipe+1], (size_t) (i-oldPipe-1));
-                    temp[i-oldPipe-1] = '\0';
-                    size = (size_t) atoi(temp);
-                    break;
-                case 5:
-                    strncpy(temp, &fBuf[oldPipe+1], (size_t) (i-oldPipe-1));
-                    temp[i-oldPipe-1] = '\0';
-                    actime = (u_int64_t) atoi(temp);
-                    break;
-                case 6:
-                    strncpy(temp, &fBuf[oldPipe+1], (size_t) (i-oldPipe-1));
-                    temp[i-oldPipe-1] = '\0';
-                    modtime = (u_int64_t) atoi(temp);
-                    break;
-                case 7:
-                    if(i-oldPipe <= 1) { break; }
-                    contents = malloc(i - oldPipe);
-                    if (!contents) {
-                        free(path);
-                        return -EFAULT;
-                    }
-                    strncpy(contents, &fBuf[oldPipe+1], (size_t) (i-oldPipe));
-                    contents[i-oldPipe-1] = '\0';
-                    break;
-            }
-            if (tokenType == 7) {
-                tokenType %= 7;
-                makeEntry(path, isFile);
-                current = findEntry(path);
-                if (!current) {
-                    free(path);
-                    free(contents);
-                    return -ENOENT;
-                }
-                current->entry->id = id;
-                current->entry->size = size;
-                current->entry->actime = actime;
-                current->entry->modtime = modtime;
-                current->entry->contents = contents;
-                free(path);
-            }
-            oldPipe = i;
-        }
-    }
-    return 0;
+void *slabObject(struct lfs_slab *slab, struct slab_page *page, size_t slot) { return (char *) page + SLAB_HEADER_SIZE + slot * slab->size; }
+
+void linkPartial(struct lfs_slab *slab, struct slab_page *page) {
+    page->prev_partial = NULL;
+    page->next_partial = slab->partial;
+    if (slab->partial) { slab->partial->prev_partial = page; }
+    slab->partial = page;
 }
 
-// struct methods
-int lfs_getattr(const char *path, struct stat *stbuf) {
-    struct LinkedListNode *current = findEntry(path);
-    if (current == NULL) { return -ENOENT; }
-    memset(stbuf, 0, sizeof(struct stat));
-    if (strcmp(path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-    } else if (current) {
-        if (current->entry->isFile) {
-            stbuf->st_mode = S_IFREG | 0777;
-            stbuf->st_nlink = 1;
-        } else {
-            stbuf->st_mode = S_IFDIR | 0755;
-            stbuf->st_nlink = 2;
-        }
-    } else { return -ENOENT; }
-    stbuf->st_ino = current->entry->id;
-    stbuf->st_size = current->entry->size;
-    stbuf->st_atime = current->entry->actime;
-    stbuf->st_mtime = current->entry->modtime;
-    return 0;
+void unlinkPartial(struct lfs_slab *slab, struct slab_page *page) {
+    if (page->prev_partial) { page->prev_partial->next_partial = page->next_partial; } else { slab->partial = page->next_partial; }
+    if (page->next_partial) { page->next_partial->prev_partial = page->prev_partial; }
 }
 
-int lfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    struct LinkedListNode *current;
-    if (!(current = findEntry(path))) { return -ENOENT; }
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-    if (current->entry->entries) {
-        struct LinkedListNode *entryToAdd = current->entry->entries->head;
-        while (entryToAdd != NULL) {
-            filler(buf, entryToAdd->entry->name, NULL, 0);
-            entryToAdd = entryToAdd->next;
-        }
+struct slab_page *allocPage(struct lfs_slab *slab) {
+    void *mem;
+    if (posix_memalign(&mem, SLAB_PAGE_SIZE, SLAB_PAGE_SIZE) != 0) { return NULL; }
+    struct slab_page *page = mem;
+    memset(page, 0, sizeof(struct slab_page));
+    size_t slot;
+    for (slot = slabPerPage(slab); slot < SLAB_MAP_WORDS * 64; ++slot) { page->map[slot / 64] |= 1ULL << (slot % 64); }
+    page->next = slab->pages;
+    if (slab->pages) { slab->pages->prev = page; }
+    slab->pages = page;
+    ++slab->num_pages;
+    linkPartial(slab, page);
+    return page;
+}
+
+void *slabAlloc(struct lfs_slab *slab) {
+    pthread_mutex_lock(&slab->lock);
+    struct slab_page *page = (slab->partial) ? slab->partial : allocPage(slab);
+    if (!page) {
+        pthread_mutex_unlock(&slab->lock);
+        return NULL;
     }
-    return 0;
+    size_t word = 0;
+    while (!~page->map[word]) { ++word; }
+    size_t slot = word * 64 + __builtin_ctzll(~page->map[word]);
+    page->map[word] |= 1ULL << (slot % 64);
+    if (++page->used == slabPerPage(slab)) { unlinkPartial(slab, page); }
+    ++slab->objects;
+    pthread_mutex_unlock(&slab->lock);
+    return slabObject(slab, page, slot);
+}
+
+// an emptied page goes back to the system unless it is the only one left
+// with room, so a create/delete cycle at a page boundary does not thrash
+void slabFree(struct lfs_slab *slab, void *object) {
+    if (!object) { return; }
+    struct slab_page *page = (struct slab_page *) ((uintptr_t) object & ~(uintptr_t) (SLAB_PAGE_SIZE - 1));
+    size_t slot = ((char *) object - (char *) page - SLAB_HEADER_SIZE) / slab->size;
+    pthread_mutex_lock(&slab->lock);
+    page->map[slot / 64] &= ~(1ULL << (slot % 64));
+    if (page->used-- == slabPerPage(slab)) { linkPartial(slab, page); }
+    --slab->objects;
+    if (page->used == 0 && (slab->partial != page || page->next_partial)) {
+        unlinkPartial(slab, page);
+        if (page->prev) { page->prev->next = page->next; } else { slab->pages = page->next; }
+        if (page->next) { page->next->prev = page->prev; }
+        --slab->num_pages;
+        free(page);
+    }
+    pthread_mutex_unlock(&slab->lock);
+}
+
+// calls release on every object still allocated, then returns all pages
+void slabDestroy(struct lfs_slab *slab, void (*release)(void *)) {
+    struct slab_page *page = slab->pages;
+    while (page != NULL) {
+        struct slab_page *next = page->next;
+        size_t slot;
+        for (slot = 0; release && slot < slabPerPage(slab); ++slot) {
+            if (page->map[slot / 64] & (1ULL << (slot % 64))) { release(slabObject(slab, page, slot)); }
+        }
+        free(page);
+        page = next;
+    }
+    slab->pages = NULL;
+    slab->partial = NULL;
+    slab->num_pages = 0;
+    slab->objects = 0;
+}
+
+// inode table methods
+struct lfs_entry *allocInode(int id) {
+    if (id < 0) { return NULL; }
+    size_t chunk = (size_t) id / INODES_PER_CHUNK;
+    pthread_mutex_lock(&inodes.lock);
+    if (!inodes.chunks[chunk] && (inodes.chunks[chunk] = calloc(1, sizeof(struct inode_chunk)))) {
+        if (chunk >= inodes.num_chunks) { inodes.num_chunks = chunk + 1; }
+        ++inodes.allocated;
+    }
+    struct lfs_entry *entry = (inodes.chunks[chunk]) ? &inodes.chunks[chunk]->inodes[id % INODES_PER_CHUNK] : NULL;
+    if (entry && entry->live) { entry = NULL; }
+    if (entry) {
+        memset(entry, 0, sizeof(struct lfs_entry));
+        entry->id = id;
+        entry->live = true;
+        ++inodes.chunks[chunk]->live;
+        ++inodes.live;
+    }
+    pthread_mutex_unlock(&inodes.lock);
+    return entry;
+}
+
+void freeInode(struct lfs_entry *entry) {
+    size_t chunk = (size_t) entry->id / INODES_PER_CHUNK;
+    pthread_mutex_lock(&inodes.lock);
+    entry->live = false;
+    --inodes.live;
+    if (--inodes.chunks[chunk]->live == 0) {
+        free(inodes.chunks[chunk]);
+        inodes.chunks[chunk] = NULL;
+        --inodes.allocated;
+    }
+    pthread_mutex_unlock(&inodes.lock);
+}
+
+// directory index methods
+static struct LinkedListNode index_tombstone;
+
+size_t hashName(const char *name) {
+    size_t hash = 14695981039346656037ULL;
+    while (*name) {
+        hash ^= (unsigned char) *name++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+struct LinkedList *allocList() {
+    struct LinkedList *list = slabAlloc(&slabs[SLAB_LIST]);
+    if (!list) { return NULL; }
+    list->head = NULL;
+    list->tail = NULL;
+    list->num_entries = 0;
+    list->index = NULL;
+    list->index_size = 0;
+    list->index_used = 0;
+    list->last_cookie = 0;
+    list->cursors = NULL;
+    list->loaded = true;
+    pthread_rwlock_init(&list->lock, NULL);
+    return list;
+}
+
+void freeList(struct LinkedList *list) {
+    if (!list) { return; }
+    pthread_rwlock_destroy(&list->lock);
+    free(list->index);
+    slabFree(&slabs[SLAB_LIST], list);
+}
+
+int resizeIndex(struct LinkedList *list, size_t size) {
+    struct LinkedListNode **index = calloc(size, sizeof(struct LinkedListNode *));
+    if (!index) { return -EFAULT; }
+    struct LinkedListNode *node;
+    for (node = list->head; node != NULL; node = node->next) {
+        size_t slot = hashName(node->name) & (size - 1);
+        while (index[slot]) { slot = (slot + 1) & (size - 1); }
+        index[slot] = node;
+    }
+    free(list->index);
+    list->index = index;
+    list->index_size = size;
+    list->index_used = list->num_entries;
+    return 0;
+}
+
+// makes room for count inserts that then cannot fail
+int indexReserve(struct LinkedList *list, size_t count) {
+    if ((list->index_used + count) * 4 <= list->index_size * 3) { return 0; }
+    size_t size = (list->index_size) ? list->index_size : INDEX_MIN_SIZE;
+    while ((list->num_entries + count) * 2 > size) { size *= 2; }
+    return resizeIndex(list, size);
+}
+
+int indexInsert(struct LinkedList *list, struct LinkedListNode *node) {
+    int res = indexReserve(list, 1);
+    if (res != 0) { return res; }
+    size_t slot = hashName(node->name) & (list->index_size - 1);
+    while (list->index[slot] && list->index[slot] != &index_tombstone) { slot = (slot + 1) & (list->index_size - 1); }
+    if (!list->index[slot]) { ++list->index_used; }
+    list->index[slot] = node;
+    return 0;
+}
+
+struct LinkedListNode **indexSlot(struct LinkedList *list, const char *name) {
+    if (!list->index_size) { return NULL; }
+    size_t slot = hashName(name) & (list->index_size - 1);
+    while (list->index[slot]) {
+        if (list->index[slot] != &index_tombstone && strcmp(list->index[slot]->name, name) == 0) { return &list->index[slot]; }
+        slot = (slot + 1) & (list->index_size - 1);
+    }
+    return NULL;
+}
+
+void indexRemove(struct LinkedList *list, struct LinkedListNode *node) {
+    struct LinkedListNode **slot = indexSlot(list, node->name);
+    if (slot && *slot == node) { *slot = &index_tombstone; }
+}
+
+// name methods
+struct lfs_slab *nameSlab(size_t len) {
+    size_t needed = offsetof(struct lfs_name, str) + len + 1;
+    int class = SLAB_NAME_32;
+    while (class < SLAB_NAME_288 && slabs[class].size < needed) { ++class; }
+    return &slabs[class];
+}
+
+int growNames() {
+    size_t size = (names.size) ? names.size * 2 : INDEX_MIN_SIZE;
+    struct lfs_name **buckets = calloc(size, sizeof(struct lfs_name *));
+    if (!buckets) { return -EFAULT; }
+    size_t i;
+    for (i = 0; i < names.size; ++i) {
+        struct lfs_name *current = names.buckets[i];
+        while (current != NULL) {
+            struct lfs_name *next = current->next;
+            current->next = buckets[current->hash & (size - 1)];
+            buckets[current->hash & (size - 1)] = current;
+            current = next;
+        }
+    }
+    free(names.buckets);
+    names.buckets = buckets;
+    names.size = size;
+    return 0;
+}
+
+// names longer than FILENAME_SIZE - 1 are cut short, as they always were
+const char *internName(const char *name) {
+    char tmp[FILENAME_SIZE];
+    size_t len = strnlen(name, FILENAME_SIZE - 1);
+    if (name[len] != '\0') {
+        memcpy(tmp, name, len);
+        tmp[len] = '\0';
+        name = tmp;
+    }
+    size_t hash = hashName(name);
+    pthread_mutex_lock(&names.lock);
+    struct lfs_name *current = (names.size) ? names.buckets[hash & (names.size - 1)] : NULL;
+    while (current && (current->hash != hash || strcmp(current->str, name) != 0)) { current = current->next; }
+    if (!current && (names.count < names.size || growNames() == 0) && (current = slabAlloc(nameSlab(len)))) {
+        current->hash = hash;
+        current->refs = 0;
+        memcpy(current->str, name, len + 1);
+        current->next = names.buckets[hash & (names.size - 1)];
+        names.buckets[hash & (names.size - 1)] = current;
+        ++names.count;
+    }
+    if (current) { ++current->refs; }
+    pthread_mutex_unlock(&names.lock);
+    return (current) ? current->str : NULL;
+}
+
+void releaseName(const char *name) {
+    if (!name) { return; }
+    struct lfs_name *interned = (struct lfs_name *) (name - offsetof(struct lfs_name, str));
+    pthread_mutex_lock(&names.lock);
+    if (--interned->refs == 0) {
+        struct lfs_name **link = &names.buckets[interned->hash & (names.size - 1)];
+        while (*link != interned) { link = &(*link)->next; }
+        *link = interned->next;
+        --names.count;
+        slabFree(nameSlab(strlen(name)), interned);
+    }
+    pthread_mutex_unlock(&names.lock);
+}
+
+// dentry cache methods
+int initDcache(size_t size) {
+    if (size == 0) { return 0; }
+    size_t slots = 1;
+    while (slots < size) { slots *= 2; }
+    if (!(dcache.slots = calloc(slots, sizeof(struct dcache_entry)))) { return -EFAULT; }
+    dcache.size = slots;
+    return 0;
+}
+
+void freeDcache() {
+    size_t i;
+    for (i = 0; i < dcache.size; ++i) { free(dcache.slots[i].path); }
+    free(dcache.slots);
+    dcache.slots = NULL;
+    dcache.size = 0;
+}
+
+struct dcache_entry *dcacheLookup(const char *path, size_t hash) {
+    if (!dcache.size) { return NULL; }
+    struct dcache_entry *slot = &dcache.slots[hash & (dcache.size - 1)];
+    if (!slot->path || slot->hash != hash || strcmp(slot->path, path) != 0) { return NULL; }
+    return slot;
+}
+
+// callers of the slot methods hold dcache.lock
+void dcacheDrop(struct dcache_entry *slot) {
+    free(slot->path);
+    slot->path = NULL;
+    slot->node = NULL;
+    ++dcache.invalidations;
+}
+
+void dcacheStore(const char *path, size_t hash, struct LinkedListNode *node) {
+    if (!dcache.size) { return; }
+    struct dcache_entry *slot = &dcache.slots[hash & (dcache.size - 1)];
+    char *copy = strdup(path);
+    if (!copy) { return; }
+    free(slot->path);
+    slot->path = copy;
+    slot->hash = hash;
+    slot->node = node;
+}
+
+void dcacheInvalidate(const char *path) {
+    pthread_mutex_lock(&dcache.lock);
+    ++dcache.generation;
+    struct dcache_entry *slot = dcacheLookup(path, hashName(path));
+    if (slot) { dcacheDrop(slot); }
+    pthread_mutex_unlock(&dcache.lock);
+}
+
+// drops path and every cached path below it
+void dcacheInvalidateTree(const char *path) {
+    size_t len = strlen(path);
+    size_t i;
+    pthread_mutex_lock(&dcache.lock);
+    ++dcache.generation;
+    for (i = 0; i < dcache.size; ++i) {
+        char *cached = dcache.slots[i].path;
+        if (cached && strncmp(cached, path, len) == 0 && (cached[len] == '\0' || cached[len] == '/')) { dcacheDrop(&dcache.slots[i]); }
+    }
+    pthread_mutex_unlock(&dcache.lock);
+}
+
+void dcacheInvalidateNode(struct LinkedListNode *node) {
+    if (!dcache.size || node == root) { return; }
+    size_t len = 0;
+    struct LinkedListNode *current;
+    for (current = node; current && current != root; current = current->entry->parent) { len += strlen(current->name) + 1; }
+    char *path = malloc(len + 1);
+    if (!path) { return; }
+    path[len] = '\0';
+    for (current = node; current && current != root; current = current->entry->parent) {
+        size_t name_len = strlen(current->name);
+        len -= name_len;
+        memcpy(path + len, current->name, name_len);
+        path[--len] = '/';
+    }
+    dcacheInvalidate(path);
+    free(path);
+}
+
+struct LinkedListNode *findEntry(const char *path) {
+    if (strcmp(path, "/") == 0) { return root; }
+    size_t hash = hashName(path);
+    pthread_mutex_lock(&dcache.lock);
+    struct dcache_entry *cached = dcacheLookup(path, hash);
+    u_int64_t generation = dcache.generation;
+    if (cached) {
+        struct LinkedListNode *node = cached->node;
+        if (node) { ++dcache.hits; }
+        else { ++dcache.negative_hits; }
+        pthread_mutex_unlock(&dcache.lock);
+        return node;
+    }
+    ++dcache.misses;
+    pthread_mutex_unlock(&dcache.lock);
+    struct LinkedListNode *current = root;
+    size_t len = strlen(path) + 1;
+    char *current_path = malloc(len);
+    if (!current_path) { return NULL; }
+    strncpy(current_path, path, len);
+    current_path[len-1] = '\0';
+    char *saveptr;
+    char *token = strtok_r(current_path, "/", &saveptr);
+    while (token != NULL && current != NULL) {
+        current = findTokenInCurrent(current, token);
+        token = strtok_r(NULL, "/", &saveptr);
+    }
+    free(current_path);
+    pthread_mutex_lock(&dcache.lock);
+    if (dcache.generation == generation) { dcacheStore(path, hash, current); }
+    pthread_mutex_unlock(&dcache.lock);
+    return current;
+}
+
+struct LinkedListNode *findTokenInCurrent(struct LinkedListNode *current, const char *token) {
+    if (current->entry->isFile || loadDirectory(current) != 0) { return NULL; }
+    pthread_rwlock_rdlock(&current->entry->entries->lock);
+    struct LinkedListNode **slot = indexSlot(current->entry->entries, token);
+    struct LinkedListNode *found = (slot) ? *slot : NULL;
+    pthread_rwlock_unlock(&current->entry->entries->lock);
+    return found;
+}	
+
+// memory budget methods. With mem_budget, crossing the budget wakes the
+// cleaner thread, which drops buffers the image holds until an eighth is
+// free again, see evictBlocks
+u_int64_t memoryBudget() { return (u_int64_t) config.mem_budget * (1024 * 1024 / BLOCK_SIZE); }
+
+bool overBudget() { return config.mem_budget && __atomic_load_n(&memory.resident, __ATOMIC_RELAXED) > memoryBudget(); }
+
+char *allocData() {
+    char *data = calloc(BLOCK_SIZE, sizeof(char));
+    if (data && __atomic_add_fetch(&memory.resident, 1, __ATOMIC_RELAXED) == memoryBudget() + 1 && config.mem_budget) {
+        pthread_cond_signal(&cleaner.wake);
+    }
+    return data;
+}
+
+void freeData(char *data) {
+    if (!data) { return; }
+    free(data);
+    __atomic_sub_fetch(&memory.resident, 1, __ATOMIC_RELAXED);
+}
+
+// marks a resident block as used since the sweep last passed it; readers
+// share the entry's lock, so the mark is set atomically
+void touchBlock(struct lfs_block *block) {
+    if (config.mem_budget && !(__atomic_load_n(&block->flags, __ATOMIC_RELAXED) & BLOCK_REFERENCED)) {
+        __atomic_fetch_or(&block->flags, BLOCK_REFERENCED, __ATOMIC_RELAXED);
+    }
+}
+
+// block cache methods; callers hold cache.lock unless noted
+int initCache(u_int32_t size) {
+    if (size == 0) { return 0; }
+    u_int32_t buckets = INDEX_MIN_SIZE;
+    while (buckets < size) { buckets *= 2; }
+    cache.slots = calloc(size + 1, sizeof(struct cached_block));
+    cache.buckets = calloc(buckets, sizeof(u_int32_t));
+    if (!cache.slots || !cache.buckets) {
+        free(cache.slots);
+        free(cache.buckets);
+        cache.slots = NULL;
+        cache.buckets = NULL;
+        return -EFAULT;
+    }
+    cache.num_slots = size;
+    cache.num_buckets = buckets;
+    return 0;
+}
+
+void freeCache() {
+    u_int32_t slot;
+    for (slot = 1; slot <= cache.used; ++slot) { free(cache.slots[slot].data); }
+    free(cache.slots);
+    free(cache.buckets);
+    cache.slots = NULL;
+    cache.buckets = NULL;
+    cache.num_slots = cache.num_buckets = cache.used = 0;
+    cache.newest = cache.oldest = 0;
+}
+
+u_int32_t *cacheBucket(off_t addr) { return &cache.buckets[((u_int64_t) addr * 0x9e3779b97f4a7c15ULL >> 32) & (cache.num_buckets - 1)]; }
+
+u_int32_t findCached(off_t addr) {
+    u_int32_t slot = *cacheBucket(addr);
+    while (slot && cache.slots[slot].addr != addr) { slot = cache.slots[slot].next; }
+    return slot;
+}
+
+void unchainCached(u_int32_t slot) {
+    u_int32_t *link = cacheBucket(cache.slots[slot].addr);
+    while (*link != slot) { link = &cache.slots[*link].next; }
+    *link = cache.slots[slot].next;
+}
+
+void unlinkCached(u_int32_t slot) {
+    struct cached_block *current = &cache.slots[slot];
+    if (current->newer) { cache.slots[current->newer].older = current->older; } else { cache.newest = current->older; }
+    if (current->older) { cache.slots[current->older].newer = current->newer; } else { cache.oldest = current->newer; }
+    current->newer = current->older = 0;
+}
+
+// puts an unlinked slot at the newest or the oldest end of the list
+void linkCached(u_int32_t slot, bool newest) {
+    struct cached_block *current = &cache.slots[slot];
+    if (newest) {
+        current->older = cache.newest;
+        if (cache.newest) { cache.slots[cache.newest].newer = slot; } else { cache.oldest = slot; }
+        cache.newest = slot;
+    } else {
+        current->newer = cache.oldest;
+        if (cache.oldest) { cache.slots[cache.oldest].older = slot; } else { cache.newest = slot; }
+        cache.oldest = slot;
+    }
+}
+
+// takes a fresh slot while there are any, the least recently used one after
+u_int32_t claimCached(off_t addr) {
+    u_int32_t slot;
+    if (cache.used < cache.num_slots) {
+        if (!(cache.slots[cache.used + 1].data = malloc(BLOCK_SIZE))) { return 0; }
+        slot = ++cache.used;
+    } else {
+        slot = cache.oldest;
+        unlinkCached(slot);
+        if (cache.slots[slot].addr) { unchainCached(slot); }
+    }
+    u_int32_t *bucket = cacheBucket(addr);
+    cache.slots[slot].addr = addr;
+    cache.slots[slot].next = *bucket;
+    *bucket = slot;
+    linkCached(slot, true);
+    return slot;
+}
+
+// drops the copies of records in [start, end), a segment about to be reused.
+// Needs no lock
+void dropCached(off_t start, off_t end) {
+    pthread_mutex_lock(&cache.lock);
+    u_int32_t slot;
+    for (slot = 1; slot <= cache.used; ++slot) {
+        struct cached_block *current = &cache.slots[slot];
+        if (current->addr < start || current->addr >= end) { continue; }
+        unchainCached(slot);
+        current->addr = 0;
+        unlinkCached(slot);
+        linkCached(slot, false);
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// copies len bytes at skip of a cold compressed block, which a miss reads
+// and decompresses into the cache; a record that fails its crc or does not
+// decompress gives -EIO. Needs no lock, the caller's hold on the block keeps
+// its record from being reused
+int readCached(struct lfs_block *block, char *buf, size_t skip, size_t len) {
+    pthread_mutex_lock(&cache.lock);
+    u_int32_t slot = (cache.num_slots) ? findCached(block->addr) : 0;
+    if (slot) {
+        ++cache.hits;
+        unlinkCached(slot);
+        linkCached(slot, true);
+        memcpy(buf, cache.slots[slot].data + skip, len);
+        pthread_mutex_unlock(&cache.lock);
+        return 0;
+    }
+    ++cache.misses;
+    pthread_mutex_unlock(&cache.lock);
+    char data[BLOCK_SIZE];
+    memset(data, 0, sizeof(data));
+    int res = readStored(block->addr, data);
+    if (res != 0) { return res; }
+    memcpy(buf, data + skip, len);
+    pthread_mutex_lock(&cache.lock);
+    if (cache.num_slots && !findCached(block->addr) && (slot = claimCached(block->addr))) { memcpy(cache.slots[slot].data, data, BLOCK_SIZE); }
+    pthread_mutex_unlock(&cache.lock);
+    return 0;
+}
+
+// block methods
+// a hole holds no buffer, record or shared block and reads as zeros
+bool isHole(struct lfs_block *block) {
+    return !block->data && !block->addr && !block->shared;
+}
+
+struct lfs_block *getBlock(struct lfs_entry *entry, size_t block, bool create) {
+    size_t index = block / BLOCKS_PER_TABLE;
+    if (index >= entry->num_tables) {
+        if (!create) { return NULL; }
+        if (index >= entry->tables_capacity) {
+            size_t capacity = (entry->tables_capacity) ? entry->tables_capacity : 1;
+            while (capacity <= index) { capacity *= 2; }
+            struct block_table **tmp = realloc(entry->tables, capacity * sizeof(struct block_table *));
+            if (!tmp) { return NULL; }
+            entry->tables = tmp;
+            entry->tables_capacity = capacity;
+        }
+        memset(entry->tables + entry->num_tables, 0, (index + 1 - entry->num_tables) * sizeof(struct block_table *));
+        entry->num_tables = index + 1;
+    }
+    if (!entry->tables[index]) {
+        if (!create) { return NULL; }
+        if (!(entry->tables[index] = calloc(1, sizeof(struct block_table)))) { return NULL; }
+    }
+    return &entry->tables[index]->blocks[block % BLOCKS_PER_TABLE];
+}
+
+int writeBlocks(struct lfs_entry *entry, const char *buf, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        size_t pos = offset + done;
+        size_t skip = pos % BLOCK_SIZE;
+        size_t len = (size - done < BLOCK_SIZE - skip) ? size - done : BLOCK_SIZE - skip;
+        struct lfs_block *block = getBlock(entry, pos / BLOCK_SIZE, true);
+        if (!block) { return -EFAULT; }
+        bool hole = isHole(block);
+        if (block->shared) {
+            int res = unshareBlock(block, len < BLOCK_SIZE);
+            if (res != 0) { return res; }
+        }
+        if (!block->data && block->addr && len < BLOCK_SIZE) {
+            int res = readBlock(block);
+            if (res != 0) { return res; }
+        }
+        if (!block->data && !(block->data = allocData())) { return -EFAULT; }
+        // counted only once it holds data, a failed write leaves the hole
+        if (hole) { ++entry->num_blocks; }
+        memcpy(block->data + skip, buf + done, len);
+        block->flags |= BLOCK_DIRTY;
+        done += len;
+    }
+    return 0;
+}
+
+// bytes of [skip, skip + len) a cold uncompressed block holds in its log
+// record, the rest are zeros
+size_t coldBytes(struct lfs_block *block, size_t skip, size_t len) {
+    size_t stored = block->len - sizeof(struct record_header) - sizeof(struct data_record);
+    if (stored <= skip) { return 0; }
+    return (stored - skip < len) ? stored - skip : len;
+}
+
+off_t coldOffset(struct lfs_block *block, size_t skip) {
+    return block->addr + sizeof(struct record_header) + sizeof(struct data_record) + skip;
+}
+
+// whether the record may hold bytes at or past skip; the length of a
+// compressed one does not tell
+bool storedPast(struct lfs_block *block, size_t skip) {
+    return block->addr && ((block->flags & RECORD_COMPRESSED) || coldBytes(block, skip, BLOCK_SIZE - skip) > 0);
+}
+
+// returns the bytes read, or -EIO when a cold block cannot be read back; a
+// short count only ever means end of file
+ssize_t readBlocks(struct lfs_entry *entry, char *buf, size_t size, off_t offset) {
+    if ((size_t) offset >= entry->size) { return 0; }
+    if (size > entry->size - offset) { size = entry->size - offset; }
+    size_t done = 0;
+    while (done < size) {
+        size_t pos = offset + done;
+        size_t skip = pos % BLOCK_SIZE;
+        size_t len = (size - done < BLOCK_SIZE - skip) ? size - done : BLOCK_SIZE - skip;
+        struct lfs_block *block = getBlock(entry, pos / BLOCK_SIZE, false);
+        if (block) { block = storedBlock(block); }
+        if (block && block->data) { 
+            memcpy(buf + done, block->data + skip, len);
+            touchBlock(block);
+        } else if (block && block->addr && (block->flags & RECORD_COMPRESSED)) {
+            if (readCached(block, buf + done, skip, len) != 0) { return -EIO; }
+        } else if (block && block->addr) {
+            size_t stored = coldBytes(block, skip, len);
+            if (stored && pread(disk_log.fd, buf + done, stored, coldOffset(block, skip)) != (ssize_t) stored) { return -EIO; }
+            memset(buf + done + stored, 0, len - stored);
+        } else { memset(buf + done, 0, len); }
+        done += len;
+    }
+    return size;
+}
+
+void freeTable(struct block_table *table) {
+    if (!table) { return; }
+    size_t i;
+    for (i = 0; i < BLOCKS_PER_TABLE; ++i) { freeData(table->blocks[i].data); }
+    free(table);
+}
+
+void freeBlocks(struct lfs_entry *entry) {
+    size_t i;
+    for (i = 0; i < entry->num_tables; ++i) { freeTable(entry->tables[i]); }
+    free(entry->tables);
+    entry->tables = NULL;
+    entry->num_tables = 0;
+    entry->tables_capacity = 0;
+    entry->num_blocks = 0;
+}
+
+// tree methods
+struct LinkedListNode *allocNode(const char *name, bool isFile, int id) {
+    struct LinkedListNode *new_node = slabAlloc(&slabs[SLAB_NODE]);
+    if (!new_node) { return NULL; }
+    new_node->entry = allocInode(id);
+    if (!new_node->entry) {
+        slabFree(&slabs[SLAB_NODE], new_node);
+        return NULL;
+    }
+    if (!(new_node->name = internName(name))) {
+        freeInode(new_node->entry);
+        slabFree(&slabs[SLAB_NODE], new_node);
+        return NULL;
+    }
+    new_node->entry->isFile = isFile;
+    new_node->entry->actime = time(NULL);
+    new_node->entry->modtime = time(NULL);
+    if (!isFile) {
+        new_node->entry->entries = allocList();
+        if (new_node->entry->entries == NULL)  { 
+            releaseName(new_node->name);
+            freeInode(new_node->entry);
+            slabFree(&slabs[SLAB_NODE], new_node);
+            return NULL;
+        }
+    }
+    pthread_rwlock_init(&new_node->entry->lock, NULL);
+    new_node->next = NULL;
+    new_node->prev = NULL;
+    return new_node;
+}
+
+// the id is only reused once no inode record for it is live
+void freeNode(struct LinkedListNode *node) {
+    int id = node->entry->id;
+    pthread_mutex_lock(&log_lock);
+    bool reusable = (size_t) id >= imap_size || imap[id].type != RECORD_INODE;
+    pthread_mutex_unlock(&log_lock);
+    pthread_rwlock_destroy(&node->entry->lock);
+    freeList(node->entry->entries);
+    if (node->entry->unlinked) { releaseShared(node->entry); }
+    freeBlocks(node->entry);
+    releaseName(node->name);
+    freeInode(node->entry);
+    // a concurrent mknod may take the id as soon as it is released, which
+    // allocInode refuses while the old inode is still live
+    if (reusable) { releaseId(id); }
+    slabFree(&slabs[SLAB_NODE], node);
+}
+
+int linkNode(struct LinkedListNode *parent, struct LinkedListNode *new_node) {
+    int res = indexInsert(parent->entry->entries, new_node);
+    if (res != 0) { return res; }
+    new_node->entry->parent = parent;
+    new_node->cookie = ++parent->entry->entries->last_cookie;
+    new_node->next = NULL;
+    new_node->prev = parent->entry->entries->tail;
+    if (new_node->prev) { new_node->prev->next = new_node; }
+    parent->entry->entries->tail = new_node;
+    if (!parent->entry->entries->head) { parent->entry->entries->head = new_node; }
+    ++parent->entry->entries->num_entries;
+    return 0;
+}
+
+// id < 0 allocates a fresh one
+int addChild(struct LinkedListNode *parent, const char *name, bool isFile, int id, struct LinkedListNode **added) {
+    if (parent->entry->isFile) { return -ENOTDIR; }
+    if (loadDirectory(parent) != 0) { return -EIO; }
+    u_int32_t generation;
+    if (nextGeneration(&generation) != 0) { return -ENOSPC; }
+    bool fresh = id < 0;
+    if (fresh && (id = generateId()) < 0) { return id; }
+    struct LinkedListNode *new_node = allocNode(name, isFile, id);
+    if (!new_node) {
+        if (fresh) { releaseId(id); }
+        return -EFAULT;
+    }
+    new_node->entry->generation = generation;
+    pthread_rwlock_wrlock(&parent->entry->entries->lock);
+    int res = (indexSlot(parent->entry->entries, new_node->name)) ? -EEXIST : linkNode(parent, new_node);
+    pthread_rwlock_unlock(&parent->entry->entries->lock);
+    if (res != 0) {
+        freeNode(new_node);
+        return (res == -EEXIST) ? res : -EFAULT;
+    }
+    if (added) { *added = new_node; }
+    return 0;
+}
+
+int makeEntry(const char *path, bool isFile, int id) {
+    size_t len = strlen(path) + 1;
+    char *current_path = malloc(len);
+    if (!current_path) { return -EFAULT; }
+    strncpy(current_path, path, len);
+    bool seekOp = true;
+    struct LinkedListNode *current = root;
+    char tmp[FILENAME_SIZE];
+    struct LinkedListNode *parent;
+    char *saveptr;
+    char *token = strtok_r(current_path, "/", &saveptr);
+
+    while (token != NULL) {
+        size_t len = strlen(token) + 1;
+        len = (len < FILENAME_SIZE) ? len : FILENAME_SIZE;
+        strncpy(tmp, token, len);
+        parent = current;
+        if (!(current = findTokenInCurrent(current, token))) {
+            seekOp = false;
+            token = strtok_r(NULL, "/", &saveptr);
+            break;
+        } 
+        token = strtok_r(NULL, "/", &saveptr);
+    }
+    int res = (!seekOp && token == NULL) ? addChild(parent, tmp, isFile, id, NULL) : -EEXIST;
+    if (res == 0) { dcacheInvalidate(path); }
+    free(current_path);
+    return res;
+}
+
+// the kernel caches attributes for cache_timeout seconds and only asks for
+// them through us, so it is told when a size changes that it did not write.
+// Everything else changes through the kernel, which is why the default is a
+// minute rather than libfuse's second. The path API of FUSE 2.9 has no
+// notifications and a directory's size and mtime would lag by up to the
+// timeout, so the path backend keeps libfuse's second
+void invalidateAttrs(struct LinkedListNode *node) {
+#ifdef LFS_LOWLEVEL
+    if (notify_chan) { fuse_lowlevel_notify_inval_inode(notify_chan, (node == root) ? FUSE_ROOT_ID : (uintptr_t) node, -1, 0); }
+#endif
+}
+
+// a directory's size is the sum of its children's and is only refreshed when
+// read. A change below marks the directories above dirty, stopping at the
+// first one that already is, so every dirty directory has dirty ancestors
+void markDirSizes(struct LinkedListNode *parent) {
+    while (parent != NULL && !__atomic_load_n(&parent->entry->size_dirty, __ATOMIC_ACQUIRE)) {
+        if (__atomic_exchange_n(&parent->entry->size_dirty, true, __ATOMIC_ACQ_REL)) { return; }
+        invalidateAttrs(parent);
+        parent = parent->entry->parent;
+    }
+}
+
+// the flag is cleared before the children are summed, so a change racing
+// with the sum marks the directory again; holding the list exclusively makes
+// a reader that finds it clean wait for a refresh in progress
+size_t dirSize(struct LinkedListNode *dir) {
+    struct LinkedList *list = dir->entry->entries;
+    size_t size;
+    if (!__atomic_load_n(&dir->entry->size_dirty, __ATOMIC_ACQUIRE)) {
+        pthread_rwlock_rdlock(&list->lock);
+        size = __atomic_load_n(&dir->entry->size, __ATOMIC_RELAXED);
+        pthread_rwlock_unlock(&list->lock);
+        return size;
+    }
+    pthread_rwlock_wrlock(&list->lock);
+    if (list->loaded && __atomic_exchange_n(&dir->entry->size_dirty, false, __ATOMIC_ACQ_REL)) {
+        size = 0;
+        struct LinkedListNode *child;
+        for (child = list->head; child != NULL; child = child->next) {
+            if (!child->entry->isFile) { 
+                size += dirSize(child);
+                continue;
+            }
+            pthread_rwlock_rdlock(&child->entry->lock);
+            size += child->entry->size;
+            pthread_rwlock_unlock(&child->entry->lock);
+        }
+        __atomic_store_n(&dir->entry->size, size, __ATOMIC_RELAXED);
+    }
+    size = __atomic_load_n(&dir->entry->size, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&list->lock);
+    return size;
+}
+
+// takes a node off its parent's list; the node keeps its name and parent. A
+// cursor on the node moves to the one before it, which resumes at the same
+// place. Exclusive
+void unlinkNode(struct LinkedListNode *current) {
+    struct LinkedListNode *parent = current->entry->parent;
+    indexRemove(parent->entry->entries, current);
+    struct dir_cursor *cursor;
+    for (cursor = parent->entry->entries->cursors; cursor != NULL; cursor = cursor->next) {
+        if (cursor->last == current) { cursor->last = current->prev; }
+    }
+    if (parent->entry->entries->head == current && parent->entry->entries->tail == current) { 
+        parent->entry->entries->head = NULL;
+        parent->entry->entries->tail = NULL;
+    } else if (current == parent->entry->entries->head) { 
+        parent->entry->entries->head = current->next;
+        current->next->prev = NULL;
+    } else if (current == parent->entry->entries->tail) { 
+        parent->entry->entries->tail = current->prev;
+        current->prev->next = NULL;
+    } else {
+        current->prev->next = current->next;
+        current->next->prev = current->prev;
+    }
+    --parent->entry->entries->num_entries;
+}
+
+int removeEntry(struct LinkedListNode *current) {
+    if (!current) { return -ENOENT; }
+    if (!current->entry->isFile && current->entry->entries != NULL && current->entry->entries->num_entries != 0) {
+        return -ENOTEMPTY; 
+    } 
+    unlinkNode(current);
+    return 0;
+}
+
+bool isBelow(struct LinkedListNode *node, struct LinkedListNode *dir) {
+    for (; node != NULL; node = node->entry->parent) {
+        if (node == dir) { return true; }
+    }
+    return false;
+}
+
+// relinks a node under parent as name, which the caller has interned, in a
+// slot of parent's index it has reserved, so nothing here can fail. The node
+// and its entry stay the same, so children and open files follow it
+void moveNode(struct LinkedListNode *node, struct LinkedListNode *parent, const char *name) {
+    struct LinkedListNode *old_parent = node->entry->parent;
+    unlinkNode(node);
+    releaseName(node->name);
+    node->name = name;
+    linkNode(parent, node);
+    markDirSizes(old_parent);
+    markDirSizes(parent);
+}
+
+int rmThisEntry(struct LinkedListNode *current) {
+    if (current && current != root) { dcacheInvalidateNode(current); }
+    int result = removeEntry(current);
+    if (result < 0) { return result; }
+    markDirSizes(current->entry->parent);
+
+    current->entry->parent = NULL;
+    current->entry->unlinked = true;
+    if (current->entry->open_count == 0) { freeNode(current); }
+    return 0;
+}
+
+void releaseList(void *list) { free(((struct LinkedList *) list)->index); }
+
+// unmount returns whole inode chunks and slab pages instead of unlinking the
+// tree node by node; this also frees unlinked entries that were still open
+void freeTree() {
+    size_t chunk, i;
+    for (chunk = 0; chunk < inodes.num_chunks; ++chunk) {
+        if (!inodes.chunks[chunk]) { continue; }
+        for (i = 0; i < INODES_PER_CHUNK; ++i) {
+            if (inodes.chunks[chunk]->inodes[i].live) { freeBlocks(&inodes.chunks[chunk]->inodes[i]); }
+        }
+        free(inodes.chunks[chunk]);
+        inodes.chunks[chunk] = NULL;
+    }
+    inodes.num_chunks = 0;
+    inodes.allocated = 0;
+    inodes.live = 0;
+    slabDestroy(&slabs[SLAB_LIST], releaseList);
+    int class;
+    for (class = 0; class < NUM_SLABS; ++class) { slabDestroy(&slabs[class], NULL); }
+    free(names.buckets);
+    names.buckets = NULL;
+    names.size = 0;
+    names.count = 0;
+    free(ids.free);
+    ids.free = NULL;
+    ids.words = 0;
+    ids.hint = 0;
+    root = NULL;
+}
+
+int parseLegacy(const char *fBuf, int filesize) {
+    struct LinkedListNode *current = NULL;
+    char *path = NULL;
+    bool isFile = false;
+    int id = 0;
+    size_t size = 0;
+    u_int64_t actime = time(NULL);
+    u_int64_t modtime = time(NULL);
+    char *contents = NULL;
+
+    int oldPipe = 0;
+    int tokenType = 0;
+    int i = 0;
+    for (i = 2; i < filesize; ++i) {
+        if (fBuf[i] == '|' || i+1 == filesize) {
+            char temp[32];
+            size_t temp_len = ((size_t) (i-oldPipe-1) < sizeof(temp)) ? (size_t) (i-oldPipe-1) : sizeof(temp) - 1;
+            ++tokenType;
+            switch (tokenType) {
+                case 1:
+                    path = malloc(i - oldPipe);
+                    if (!path) { return -EFAULT; }
+                    strncpy(path, &fBuf[oldPipe+1], (size_t) (i-oldPipe-1));
+                    path[i-oldPipe-1] = '\0';
+                    break;
+                case 2:
+                    isFile = (fBuf[i-1] == '1');
+                    break;
+                case 3:
+                    strncpy(temp, &fBuf[oldPipe+1], temp_len);
+                    temp[temp_len] = '\0';
+                    id = atoi(temp);
+                    break;
+                case 4:
+                    strncpy(temp, &fBuf[oldPipe+1], temp_len);
+                    temp[temp_len] = '\0';
+                    size = (size_t) atoi(temp);
+                    break;
+                case 5:
+                    strncpy(temp, &fBuf[oldPipe+1], temp_len);
+                    temp[temp_len] = '\0';
+                    actime = (u_int64_t) atoi(temp);
+                    break;
+                case 6:
+                    strncpy(temp, &fBuf[oldPipe+1], temp_len);
+                    temp[temp_len] = '\0';
+                    modtime = (u_int64_t) atoi(temp);
+                    break;
+                case 7:
+                    if(i-oldPipe <= 1) { break; }
+                    contents = calloc(((size_t) (i - oldPipe) > size) ? (size_t) (i - oldPipe) : size + 1, sizeof(char));
+                    if (!contents) {
+                        free(path);
+                        return -EFAULT;
+                    }
+                    strncpy(contents, &fBuf[oldPipe+1], (size_t) (i-oldPipe));
+                    contents[i-oldPipe-1] = '\0';
+                    break;
+            }
+            if (tokenType == 7) {
+                tokenType %= 7;
+                makeEntry(path, isFile, id);
+                current = findEntry(path);
+                if (!current) {
+                    free(path);
+                    free(contents);
+                    return -ENOENT;
+                }
+                if (id >= CURRENT_ID) { CURRENT_ID = id + 1; }
+                current->entry->size = size;
+                current->entry->actime = actime;
+                current->entry->modtime = modtime;
+                if (contents && writeBlocks(current->entry, contents, size, 0) != 0) {
+                    free(path);
+                    free(contents);
+                    return -EFAULT;
+                }
+                free(contents);
+                contents = NULL;
+                free(path);
+            }
+            oldPipe = i;
+        }
+    }
+    return 0;
+}
+
+int loadFromDisk() {
+    int fd;
+    if ((fd = open(DISK_PATH, O_RDONLY)) < 0) { return -1; }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -EIO;
+    }
+    int filesize = st.st_size;
+    if (filesize == 0) {
+        close(fd);
+        return 0;
+    }
+    const char *fBuf = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (fBuf == MAP_FAILED) { return -EIO; }
+    int res = parseLegacy(fBuf, filesize);
+    munmap((void *) fBuf, filesize);
+    return res;
+}
+
+// log methods
+off_t segmentStart(u_int32_t segment) { return SUPERBLOCK_SIZE + (off_t) segment * SEGMENT_SIZE; }
+
+int writeAt(off_t offset, const void *buf, size_t len) {
+    return (pwrite(disk_log.fd, buf, len, offset) == (ssize_t) len) ? 0 : -EIO;
+}
+
+int writeBackTo(off_t end);
+
+int readAt(off_t offset, void *buf, size_t len) {
+    int res = writeBackTo(offset + len);
+    if (res != 0) { return res; }
+    return (pread(disk_log.fd, buf, len, offset) == (ssize_t) len) ? 0 : -EIO;
+}
+
+u_int32_t recordChecksum(const struct record_header *header, const void *payload) {
+    struct record_header tmp = *header;
+    tmp.crc = 0;
+    return checksum(checksum(0, &tmp, sizeof(tmp)), payload, header->length);
+}
+
+// writes the current checkpoint; crc covers the superblock with crc == 0
+// followed by the chunk addresses
+int writeSuperblock() {
+    char buf[SUPERBLOCK_SIZE];
+    struct lfs_superblock sb = disk_log.checkpoint;
+    sb.magic = LFS_MAGIC;
+    sb.version = LFS_VERSION;
+    sb.segment_size = SEGMENT_SIZE;
+    sb.num_segments = disk_log.num_segments;
+    sb.block_size = BLOCK_SIZE;
+    sb.next_generation = __atomic_load_n(&ids.generation, __ATOMIC_RELAXED);
+    sb.crc = 0;
+    sb.crc = checksum(checksum(0, &sb, sizeof(sb)), disk_log.chunks, sb.num_chunks * sizeof(u_int64_t));
+    memcpy(buf, &sb, sizeof(sb));
+    memcpy(buf + sizeof(sb), disk_log.chunks, sb.num_chunks * sizeof(u_int64_t));
+    return writeAt(0, buf, sizeof(sb) + sb.num_chunks * sizeof(u_int64_t));
+}
+
+u_int32_t segmentOf(off_t addr) { return (addr - SUPERBLOCK_SIZE) / SEGMENT_SIZE; }
+
+void releaseBytes(off_t addr, size_t bytes) {
+    if (addr == 0) { return; }
+    struct segment_usage *usage = &disk_log.usage[segmentOf(addr)];
+    usage->live_bytes = (usage->live_bytes > bytes) ? usage->live_bytes - bytes : 0;
+}
+
+struct imap_entry *imapEntry(int id) {
+    if ((size_t) id >= imap_size) {
+        size_t new_size = (imap_size) ? imap_size : 64;
+        while (new_size <= (size_t) id) { new_size *= 2; }
+        struct imap_entry *tmp = realloc(imap, new_size * sizeof(struct imap_entry));
+        if (!tmp) { return NULL; }
+        memset(tmp + imap_size, 0, (new_size - imap_size) * sizeof(struct imap_entry));
+        imap = tmp;
+        imap_size = new_size;
+    }
+    return &imap[id];
+}
+
+int growUsage(u_int32_t num_segments) {
+    struct segment_usage *tmp = realloc(disk_log.usage, num_segments * sizeof(struct segment_usage));
+    if (!tmp) { return -EFAULT; }
+    memset(tmp + disk_log.num_segments, 0, (num_segments - disk_log.num_segments) * sizeof(struct segment_usage));
+    disk_log.usage = tmp;
+    disk_log.num_segments = num_segments;
+    return 0;
+}
+
+// writes the buffered records of the current segment to the image,
+// followed by an end marker; callers hold log_lock
+int writeBack() {
+    if (!disk_log.wbuf || disk_log.flushed >= disk_log.tail) { return 0; }
+    struct record_header end;
+    memset(&end, 0, sizeof(end));
+    size_t len = disk_log.tail - disk_log.flushed;
+    struct iovec iov[2] = { { disk_log.wbuf + (disk_log.flushed - segmentStart(disk_log.current_segment)), len }, { &end, sizeof(end) } };
+    if (pwritev(disk_log.fd, iov, 2, disk_log.flushed) != (ssize_t) (len + sizeof(end))) { return -EIO; }
+    __atomic_store_n(&disk_log.flushed, disk_log.tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// makes sure the image holds every record below end before it is read
+int writeBackTo(off_t end) {
+    if (end <= __atomic_load_n(&disk_log.flushed, __ATOMIC_ACQUIRE)) { return 0; }
+    pthread_mutex_lock(&log_lock);
+    int res = writeBack();
+    pthread_mutex_unlock(&log_lock);
+    return res;
+}
+
+// writes back and waits for everything appended so far to reach the disk
+int flushLog() {
+    pthread_mutex_lock(&log_lock);
+    int res = writeBack();
+    off_t end = disk_log.tail;
+    pthread_mutex_unlock(&log_lock);
+    if (res != 0 || end <= __atomic_load_n(&disk_log.synced, __ATOMIC_ACQUIRE)) { return res; }
+    if (fdatasync(disk_log.fd) != 0) { return -errno; }
+    __atomic_store_n(&disk_log.synced, end, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// called by mutating callbacks once their records are appended
+int commitOp() { return (config.durable) ? flushLog() : 0; }
+
+int openSegment(u_int32_t segment) {
+    struct segment_header header = { SEGMENT_MAGIC, time(NULL), disk_log.segment_seq++, 0, 0 };
+    header.crc = checksum(0, &header, sizeof(header));
+    struct record_header end;
+    memset(&end, 0, sizeof(end));
+    off_t start = segmentStart(segment);
+    int res = writeBack();
+    if (res != 0) { return res; }
+    if (segment >= disk_log.num_segments) {
+        if ((res = growUsage(segment + 1)) != 0) { return res; }
+        if ((res = writeSuperblock()) != 0) { return res; }
+    } else if (disk_log.usage[segment].state == SEGMENT_FREE) { --disk_log.free_segments; }
+    dropCached(start, segmentStart(segment + 1));
+    if ((res = writeAt(start, &header, sizeof(header))) != 0) { return res; }
+    if ((res = writeAt(start + sizeof(header), &end, sizeof(end))) != 0) { return res; }
+    if (disk_log.current_segment < disk_log.num_segments && disk_log.usage[disk_log.current_segment].state == SEGMENT_ACTIVE) {
+        disk_log.usage[disk_log.current_segment].state = SEGMENT_DIRTY;
+    }
+    disk_log.usage[segment].state = SEGMENT_ACTIVE;
+    disk_log.usage[segment].live_bytes = 0;
+    disk_log.usage[segment].mtime = header.mtime;
+    disk_log.current_segment = segment;
+    disk_log.tail = start + sizeof(header);
+    __atomic_store_n(&disk_log.flushed, disk_log.tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int openNextSegment() {
+    u_int32_t segment = disk_log.num_segments;
+    if (disk_log.free_segments > 0) {
+        for (segment = 0; segment < disk_log.num_segments; ++segment) {
+            if (disk_log.usage[segment].state == SEGMENT_FREE) { break; }
+        }
+    }
+    int res = openSegment(segment);
+    if (res == 0 && disk_log.free_segments < config.clean_low) { pthread_cond_signal(&cleaner.wake); }
+    return res;
+}
+
+int appendRecord(u_int32_t type, u_int32_t flags, int id, const void *payload, size_t len, off_t *addr) {
+    if (len > MAX_RECORD_PAYLOAD) { return -EFBIG; }
+    int res;
+    size_t needed = sizeof(struct record_header) + len;
+    struct imap_entry *entry = NULL;
+    if (id >= 0 && !(entry = imapEntry(id))) { return -EFAULT; }
+    if (disk_log.tail + needed + sizeof(struct record_header) > segmentStart(disk_log.current_segment + 1)) {
+        if ((res = openNextSegment()) != 0) { return res; }
+    }
+    struct record_header header = { type, len, disk_log.record_seq++, id, 0, flags };
+    header.crc = recordChecksum(&header, payload);
+    if (disk_log.wbuf) {
+        char *dst = disk_log.wbuf + (disk_log.tail - segmentStart(disk_log.current_segment));
+        memcpy(dst, &header, sizeof(header));
+        if (len > 0) { memcpy(dst + sizeof(header), payload, len); }
+        if (disk_log.tail + needed - disk_log.flushed >= config.commit_bytes) { pthread_cond_signal(&flusher.wake); }
+    } else {
+        struct record_header end;
+        memset(&end, 0, sizeof(end));
+        struct iovec iov[3] = { { &header, sizeof(header) }, { (void *) payload, len }, { &end, sizeof(end) } };
+        if (pwritev(disk_log.fd, iov, 3, disk_log.tail) != (ssize_t) (needed + sizeof(end))) { return -EIO; }
+        __atomic_store_n(&disk_log.flushed, disk_log.tail + needed, __ATOMIC_RELEASE);
+    }
+    if (addr) { *addr = disk_log.tail; }
+    disk_log.tail += needed;
+    disk_log.usage[disk_log.current_segment].live_bytes += needed;
+    if (entry) { ++entry->records; }
+    return 0;
+}
+
+// shared block methods; callers hold log_lock unless noted
+struct shared_block *sharedBlock(u_int32_t id) { return &shared.pages[id / SHARED_PER_PAGE]->blocks[id % SHARED_PER_PAGE]; }
+
+// bytes the record stores, compressed or not
+size_t sharedLength(struct shared_block *current) { return current->block.len - sizeof(struct record_header) - sizeof(struct data_record); }
+
+// needs no lock, the caller's reference keeps the shared block in place
+struct lfs_block *storedBlock(struct lfs_block *block) { return (block->shared) ? &sharedBlock(block->shared)->block : block; }
+
+u_int64_t hashBlock(const char *data, size_t len) {
+    u_int64_t hash = 14695981039346656037ULL ^ len;
+    size_t i;
+    for (i = 0; i + sizeof(u_int64_t) <= len; i += sizeof(u_int64_t)) {
+        u_int64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash ^= word * 0x9e3779b97f4a7c15ULL;
+        hash = ((hash << 31) | (hash >> 33)) * 1099511628211ULL;
+    }
+    for (; i < len; ++i) { hash = (hash ^ (unsigned char) data[i]) * 1099511628211ULL; }
+    return hash ^ (hash >> 32);
+}
+
+// makes ids below size usable
+int growShared(u_int32_t size) {
+    if (size > SHARED_PAGES * SHARED_PER_PAGE) { return -EFBIG; }
+    u_int32_t page;
+    for (page = 0; page * SHARED_PER_PAGE < size; ++page) {
+        if (!shared.pages[page] && !(shared.pages[page] = calloc(1, sizeof(struct shared_page)))) { return -EFAULT; }
+    }
+    if (size > shared.size) { shared.size = size; }
+    return 0;
+}
+
+int growBuckets() {
+    size_t size = (shared.num_buckets) ? shared.num_buckets * 2 : INDEX_MIN_SIZE;
+    u_int32_t *buckets = calloc(size, sizeof(u_int32_t));
+    if (!buckets) { return -EFAULT; }
+    size_t i;
+    for (i = 0; i < shared.num_buckets; ++i) {
+        u_int32_t chained = shared.buckets[i];
+        while (chained) {
+            struct shared_block *moved = sharedBlock(chained);
+            u_int32_t next = moved->next;
+            moved->next = buckets[moved->hash & (size - 1)];
+            buckets[moved->hash & (size - 1)] = chained;
+            chained = next;
+        }
+    }
+    free(shared.buckets);
+    shared.buckets = buckets;
+    shared.num_buckets = size;
+    return 0;
+}
+
+// a table that cannot grow only makes the chains longer
+int linkShared(u_int32_t id) {
+    struct shared_block *current = sharedBlock(id);
+    if (shared.count >= shared.num_buckets && growBuckets() != 0 && !shared.num_buckets) { return -EFAULT; }
+    current->next = shared.buckets[current->hash & (shared.num_buckets - 1)];
+    shared.buckets[current->hash & (shared.num_buckets - 1)] = id;
+    ++shared.count;
+    shared.stored_bytes += sharedLength(current);
+    return 0;
+}
+
+void unlinkShared(u_int32_t id) {
+    struct shared_block *current = sharedBlock(id);
+    u_int32_t *link = &shared.buckets[current->hash & (shared.num_buckets - 1)];
+    while (*link != id) { link = &sharedBlock(*link)->next; }
+    *link = current->next;
+    --shared.count;
+    shared.stored_bytes -= sharedLength(current);
+}
+
+u_int32_t allocShared() {
+    u_int32_t id = shared.free;
+    if (id) {
+        shared.free = sharedBlock(id)->next;
+        return id;
+    }
+    id = (shared.size) ? shared.size : 1;
+    return (growShared(id + 1) == 0) ? id : 0;
+}
+
+// a cold candidate is read back, the hash alone does not decide. Blocks are
+// zero past their length, so whole blocks are compared; the stored length of
+// a compressed one is not the length of its contents
+u_int32_t findShared(const char *data, u_int64_t hash) {
+    if (!shared.num_buckets) { return 0; }
+    u_int32_t id = shared.buckets[hash & (shared.num_buckets - 1)];
+    for (; id; id = sharedBlock(id)->next) {
+        struct shared_block *current = sharedBlock(id);
+        if (current->hash != hash) { continue; }
+        if (current->block.data) {
+            if (memcmp(current->block.data, data, BLOCK_SIZE) == 0) { return id; }
+            continue;
+        }
+        char stored[BLOCK_SIZE];
+        memset(stored, 0, sizeof(stored));
+        if (readStored(current->block.addr, stored) == 0 && memcmp(stored, data, BLOCK_SIZE) == 0) { return id; }
+    }
+    return 0;
+}
+
+void addReference(struct shared_block *current) {
+    ++current->refs;
+    ++shared.references;
+    shared.referenced_bytes += sharedLength(current);
+}
+
+// the last reference frees the record and the buffer
+void dropShared(u_int32_t id) {
+    pthread_mutex_lock(&log_lock);
+    struct shared_block *current = sharedBlock(id);
+    --shared.references;
+    shared.referenced_bytes -= sharedLength(current);
+    if (--current->refs == 0) {
+        unlinkShared(id);
+        releaseBytes(current->block.addr, current->block.len);
+        freeData(current->block.data);
+        memset(&current->block, 0, sizeof(struct lfs_block));
+        current->next = shared.released;
+        shared.released = id;
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+// hands a block's buffer to the shared store, which appends it only when no
+// shared block holds the same bytes yet
+int shareBlock(struct lfs_entry *entry, struct lfs_block *block, size_t index, size_t length) {
+    u_int64_t hash = hashBlock(block->data, length);
+    u_int32_t id = findShared(block->data, hash);
+    if (id) {
+        ++shared.hits;
+        freeData(block->data);
+    } else {
+        if (!(id = allocShared())) { return -EFAULT; }
+        char payload[sizeof(struct data_record) + BLOCK_SIZE];
+        struct data_record record = { id };
+        memcpy(payload, &record, sizeof(record));
+        u_int32_t flags;
+        size_t stored = packBlock(entry, block->data, length, payload + sizeof(record), &flags);
+        off_t addr;
+        struct shared_block *current = sharedBlock(id);
+        int res = appendRecord(RECORD_SHARED, flags, -1, payload, sizeof(record) + stored, &addr);
+        if (res == 0) {
+            current->block.addr = addr;
+            current->block.len = sizeof(struct record_header) + sizeof(record) + stored;
+            current->block.flags = flags;
+            current->hash = hash;
+            res = linkShared(id);
+            if (res != 0) { releaseBytes(addr, current->block.len); }
+        }
+        if (res != 0) {
+            memset(&current->block, 0, sizeof(struct lfs_block));
+            current->next = shared.free;
+            shared.free = id;
+            return res;
+        }
+        current->block.data = block->data;
+    }
+    addReference(sharedBlock(id));
+    releaseBytes(block->addr, block->len);
+    memset(block, 0, sizeof(struct lfs_block));
+    block->shared = id;
+    entry->tables[index / BLOCKS_PER_TABLE]->dirty = true;
+    return 0;
+}
+
+// gives a block about to be changed its own copy of the contents; copy is
+// false when the write covers the whole block. Needs no lock
+int unshareBlock(struct lfs_block *block, bool copy) {
+    struct lfs_block *stored = storedBlock(block);
+    char *data = allocData();
+    if (!data) { return -EFAULT; }
+    int res = 0;
+    if (copy && stored->data) { memcpy(data, stored->data, BLOCK_SIZE); }
+    else if (copy) { res = readStored(stored->addr, data); }
+    if (res != 0) {
+        freeData(data);
+        return res;
+    }
+    dropShared(block->shared);
+    block->shared = 0;
+    block->data = data;
+    return 0;
+}
+
+// the references of an unlinked entry end with it
+void releaseShared(struct lfs_entry *entry) {
+    size_t i, j;
+    for (i = 0; i < entry->num_tables; ++i) {
+        struct block_table *table = entry->tables[i];
+        for (j = 0; table && j < BLOCKS_PER_TABLE; ++j) {
+            if (table->blocks[j].shared) { dropShared(table->blocks[j].shared); }
+        }
+    }
+}
+
+// ids released by the time a checkpoint was taken, first and those below it
+// on the stack, are safe to hand out again once it is on disk, as no table in
+// it names them; ids released later wait for the next one
+void recycleShared(u_int32_t first) {
+    u_int32_t *link = &shared.released;
+    while (*link && *link != first) { link = &sharedBlock(*link)->next; }
+    while (*link) {
+        u_int32_t id = *link;
+        *link = sharedBlock(id)->next;
+        sharedBlock(id)->next = shared.free;
+        shared.free = id;
+    }
+}
+
+void freeShared() {
+    u_int32_t page, i;
+    for (page = 0; page < SHARED_PAGES && page * SHARED_PER_PAGE < shared.size; ++page) {
+        for (i = 0; shared.pages[page] && i < SHARED_PER_PAGE; ++i) { freeData(shared.pages[page]->blocks[i].block.data); }
+        free(shared.pages[page]);
+    }
+    free(shared.buckets);
+    memset(&shared, 0, sizeof(shared));
+}
+
+int logBlock(struct lfs_entry *entry, size_t index) {
+    struct lfs_block *block = getBlock(entry, index, false);
+    if (!block || !block->data) { return 0; }
+    size_t start = index * BLOCK_SIZE;
+    size_t length = (entry->size > start) ? entry->size - start : 0;
+    if (length > BLOCK_SIZE) { length = BLOCK_SIZE; }
+    if (config.dedup) { return shareBlock(entry, block, index, length); }
+    char payload[sizeof(struct data_record) + BLOCK_SIZE];
+    struct data_record record = { index };
+    memcpy(payload, &record, sizeof(record));
+    u_int32_t flags;
+    size_t stored = packBlock(entry, block->data, length, payload + sizeof(record), &flags);
+    off_t addr;
+    int res = appendRecord(RECORD_DATA, flags, entry->id, payload, sizeof(record) + stored, &addr);
+    if (res != 0) { return res; }
+    releaseBytes(block->addr, block->len);
+    block->addr = addr;
+    block->len = sizeof(struct record_header) + sizeof(record) + stored;
+    block->flags = flags;
+    entry->tables[index / BLOCKS_PER_TABLE]->dirty = true;
+    return 0;
+}
+
+int logBlocks(struct lfs_entry *entry, off_t offset, size_t size) {
+    if (size == 0) { return 0; }
+    pthread_mutex_lock(&log_lock);
+    int res = 0;
+    size_t index;
+    for (index = offset / BLOCK_SIZE; index <= (offset + size - 1) / BLOCK_SIZE && res == 0; ++index) {
+        res = logBlock(entry, index);
+    }
+    pthread_mutex_unlock(&log_lock);
+    return res;
+}
+
+int logTable(struct lfs_entry *entry, size_t index) {
+    struct block_table *table = entry->tables[index];
+    u_int32_t count = BLOCKS_PER_TABLE;
+    while (count > 0 && table->blocks[count - 1].addr == 0 && table->blocks[count - 1].shared == 0) { --count; }
+    char payload[sizeof(struct indirect_record) + BLOCKS_PER_TABLE * sizeof(struct block_pointer)];
+    struct indirect_record record = { index, count };
+    memcpy(payload, &record, sizeof(record));
+    u_int32_t i;
+    for (i = 0; i < count; ++i) {
+        struct block_pointer pointer = { table->blocks[i].addr, table->blocks[i].len, table->blocks[i].flags & ~BLOCK_MEMORY_FLAGS, table->blocks[i].shared };
+        memcpy(payload + sizeof(record) + i * sizeof(pointer), &pointer, sizeof(pointer));
+    }
+    size_t len = sizeof(record) + count * sizeof(struct block_pointer);
+    off_t addr;
+    int res = appendRecord(RECORD_INDIRECT, 0, entry->id, payload, len, &addr);
+    if (res != 0) { return res; }
+    releaseBytes(table->addr, table->len);
+    table->addr = addr;
+    table->len = sizeof(struct record_header) + len;
+    table->dirty = false;
+    return 0;
+}
+
+int logInode(struct LinkedListNode *node) {
+    pthread_mutex_lock(&log_lock);
+    struct lfs_entry *entry = node->entry;
+    int res = 0;
+    size_t i;
+    for (i = 0; entry->isFile && i < entry->num_tables && res == 0; ++i) {
+        if (entry->tables[i] && entry->tables[i]->dirty) { res = logTable(entry, i); }
+    }
+    if (res != 0) {
+        pthread_mutex_unlock(&log_lock);
+        return res;
+    }
+    size_t name_len = strlen(node->name);
+    size_t num_tables = (entry->isFile) ? entry->num_tables : 0;
+    size_t len = sizeof(struct inode_record) + name_len + num_tables * sizeof(u_int64_t);
+    char *payload = malloc(len);
+    if (!payload) { 
+        pthread_mutex_unlock(&log_lock);
+        return -EFAULT; 
+    }
+    struct inode_record record;
+    memset(&record, 0, sizeof(record));
+    record.parent = (entry->parent) ? entry->parent->entry->id : -1;
+    record.size = __atomic_load_n(&entry->size, __ATOMIC_RELAXED);
+    record.actime = entry->actime;
+    record.modtime = entry->modtime;
+    record.isFile = entry->isFile;
+    record.name_len = name_len;
+    record.num_tables = num_tables;
+    record.generation = entry->generation;
+    memcpy(payload, &record, sizeof(record));
+    memcpy(payload + sizeof(record), node->name, name_len);
+    for (i = 0; i < num_tables; ++i) {
+        u_int64_t addr = (entry->tables[i]) ? entry->tables[i]->addr : 0;
+        memcpy(payload + sizeof(record) + name_len + i * sizeof(addr), &addr, sizeof(addr));
+    }
+    off_t addr;
+    res = appendRecord(RECORD_INODE, 0, entry->id, payload, len, &addr);
+    free(payload);
+    if (res == 0) {
+        struct imap_entry *current = &imap[entry->id];
+        if (current->node || current->type == RECORD_DELETE) { releaseBytes(current->addr, current->len); }
+        current->addr = addr;
+        current->len = sizeof(struct record_header) + len;
+        current->type = RECORD_INODE;
+        current->is_file = entry->isFile;
+        current->generation = entry->generation;
+        current->node = node;
+    }
+    pthread_mutex_unlock(&log_lock);
+    return res;
+}
+
+void releaseBlocks(struct lfs_entry *entry) {
+    size_t i, j;
+    for (i = 0; i < entry->num_tables; ++i) {
+        struct block_table *table = entry->tables[i];
+        if (!table) { continue; }
+        for (j = 0; j < BLOCKS_PER_TABLE; ++j) { releaseBytes(table->blocks[j].addr, table->blocks[j].len); }
+        releaseBytes(table->addr, table->len);
+    }
+}
+
+// turns a block into a hole; the records of an unlinked entry were released
+// with its delete record. Callers hold log_lock
+void dropBlock(struct lfs_entry *entry, struct block_table *table, struct lfs_block *block) {
+    if (isHole(block)) { return; }
+    if (!entry->unlinked) { releaseBytes(block->addr, block->len); }
+    if (block->shared) { dropShared(block->shared); }
+    freeData(block->data);
+    memset(block, 0, sizeof(struct lfs_block));
+    table->dirty = true;
+    --entry->num_blocks;
+}
+
+// drops the blocks past size and zeroes the tail of the last one, returns 1
+// when that block is stored on disk with bytes past the new end and so has to
+// be logged again; an unlinked entry keeps it dirty in memory instead
+int trimBlocks(struct lfs_entry *entry, size_t size) {
+    pthread_mutex_lock(&log_lock);
+    size_t keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t num_tables = (keep + BLOCKS_PER_TABLE - 1) / BLOCKS_PER_TABLE;
+    size_t i, j;
+    for (i = 0; i < entry->num_tables; ++i) {
+        struct block_table *table = entry->tables[i];
+        if (!table) { continue; }
+        for (j = (i * BLOCKS_PER_TABLE < keep) ? keep - i * BLOCKS_PER_TABLE : 0; j < BLOCKS_PER_TABLE; ++j) {
+            dropBlock(entry, table, &table->blocks[j]);
+        }
+        if (i >= num_tables) {
+            if (!entry->unlinked) { releaseBytes(table->addr, table->len); }
+            free(table);
+            entry->tables[i] = NULL;
+        }
+    }
+    if (entry->num_tables > num_tables) { entry->num_tables = num_tables; }
+    size_t tail = size % BLOCK_SIZE;
+    struct lfs_block *last = (tail) ? getBlock(entry, size / BLOCK_SIZE, false) : NULL;
+    int res = 0;
+    bool unshared = last && last->shared && storedPast(storedBlock(last), tail);
+    if (unshared) { res = unshareBlock(last, true); }
+    if (res == 0 && last && !last->data && storedPast(last, tail)) { res = readBlock(last); }
+    if (res == 0 && last && last->data) {
+        memset(last->data + tail, 0, BLOCK_SIZE - tail);
+        res = unshared || storedPast(last, tail);
+        if (res) { last->flags |= BLOCK_DIRTY; }
+    }
+    pthread_mutex_unlock(&log_lock);
+    return res;
+}
+
+// zeroes len bytes at skip of a block that is not a hole and logs it unless
+// the entry is unlinked; callers hold log_lock
+int zeroBlock(struct lfs_entry *entry, size_t index, size_t skip, size_t len) {
+    struct lfs_block *block = getBlock(entry, index, false);
+    if (!block || isHole(block)) { return 0; }
+    int res = (block->shared) ? unshareBlock(block, true) : 0;
+    if (res == 0 && !block->data) { res = readBlock(block); }
+    if (res != 0) { return res; }
+    memset(block->data + skip, 0, len);
+    block->flags |= BLOCK_DIRTY;
+    return (entry->unlinked) ? 0 : logBlock(entry, index);
+}
+
+// turns the blocks [start, end) covers whole into holes and zeroes the rest
+// of it in the blocks at either edge. The last block counts as covered when
+// end is the end of the file, and a table that is covered goes with its blocks
+int punchBlocks(struct lfs_entry *entry, size_t start, size_t end) {
+    if (end > entry->size) { end = entry->size; }
+    if (start >= end) { return 0; }
+    pthread_mutex_lock(&log_lock);
+    size_t first = (start + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t last = (end == entry->size) ? (end + BLOCK_SIZE - 1) / BLOCK_SIZE : end / BLOCK_SIZE;
+    size_t i, j;
+    for (i = first / BLOCKS_PER_TABLE; first < last && i <= (last - 1) / BLOCKS_PER_TABLE && i < entry->num_tables; ++i) {
+        struct block_table *table = entry->tables[i];
+        if (!table) { continue; }
+        size_t from = (i * BLOCKS_PER_TABLE < first) ? first - i * BLOCKS_PER_TABLE : 0;
+        size_t to = ((i + 1) * BLOCKS_PER_TABLE > last) ? last - i * BLOCKS_PER_TABLE : BLOCKS_PER_TABLE;
+        for (j = from; j < to; ++j) { dropBlock(entry, table, &table->blocks[j]); }
+        if (from == 0 && to == BLOCKS_PER_TABLE) {
+            if (!entry->unlinked) { releaseBytes(table->addr, table->len); }
+            free(table);
+            entry->tables[i] = NULL;
+        }
+    }
+    int res = 0;
+    if (start % BLOCK_SIZE) {
+        size_t stop = (end < first * BLOCK_SIZE) ? end : first * BLOCK_SIZE;
+        res = zeroBlock(entry, start / BLOCK_SIZE, start % BLOCK_SIZE, stop - start);
+    }
+    if (res == 0 && last >= first && last * BLOCK_SIZE < end) { res = zeroBlock(entry, last, 0, end - last * BLOCK_SIZE); }
+    pthread_mutex_unlock(&log_lock);
+    return res;
+}
+
+// the delete record of a file still open releases its block records, after
+// which the cleaner may hand their space to other data. The blocks then live
+// in memory only, so cold ones are read back first and kept from eviction.
+// Exclusive
+int residentBlocks(struct lfs_entry *entry) {
+    int res = 0;
+    pthread_rwlock_wrlock(&entry->lock);
+    pthread_mutex_lock(&log_lock);
+    size_t i, j;
+    for (i = 0; res == 0 && i < entry->num_tables; ++i) {
+        struct block_table *table = entry->tables[i];
+        for (j = 0; table && res == 0 && j < BLOCKS_PER_TABLE; ++j) {
+            struct lfs_block *block = &table->blocks[j];
+            if (!block->data && block->addr && !block->shared) { res = readBlock(block); }
+            if (res == 0 && block->data) { block->flags |= BLOCK_DIRTY; }
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+    pthread_rwlock_unlock(&entry->lock);
+    return res;
+}
+
+int logDelete(struct LinkedListNode *node) {
+    if (node->entry->isFile && __atomic_load_n(&node->entry->open_count, __ATOMIC_RELAXED) > 0) {
+        int res = residentBlocks(node->entry);
+        if (res != 0) { return res; }
+    }
+    pthread_mutex_lock(&log_lock);
+    int id = node->entry->id;
+    off_t addr;
+    int res = appendRecord(RECORD_DELETE, 0, id, NULL, 0, &addr);
+    if (res == 0) {
+        struct imap_entry *current = &imap[id];
+        releaseBytes(current->addr, current->len);
+        if (node->entry->isFile) { releaseBlocks(node->entry); }
+        current->addr = addr;
+        current->len = sizeof(struct record_header);
+        current->type = RECORD_DELETE;
+        current->node = NULL;
+    }
+    pthread_mutex_unlock(&log_lock);
+    return res;
+}
+
+// logInode for callers not holding the entry's lock
+int logEntry(struct LinkedListNode *node) {
+    pthread_rwlock_wrlock(&node->entry->lock);
+    int res = logInode(node);
+    pthread_rwlock_unlock(&node->entry->lock);
+    return res;
+}
+
+int logTree(struct LinkedListNode *node) {
+    int res;
+    if (node->entry->isFile && (res = logBlocks(node->entry, 0, node->entry->size)) != 0) { return res; }
+    if ((res = logInode(node)) != 0) { return res; }
+    if (!node->entry->isFile) {
+        struct LinkedListNode *child = node->entry->entries->head;
+        while (child != NULL) {
+            if ((res = logTree(child)) != 0) { return res; }
+            child = child->next;
+        }
+    }
+    return 0;
+}
+
+int formatLog() {
+    if (disk_log.fd >= 0) { close(disk_log.fd); }
+    if ((disk_log.fd = open(DISK_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) { return -errno; }
+    free(disk_log.usage);
+    disk_log.usage = NULL;
+    disk_log.free_segments = 0;
+    disk_log.num_segments = 0;
+    disk_log.segment_seq = 1;
+    disk_log.record_seq = 1;
+    memset(&disk_log.checkpoint, 0, sizeof(disk_log.checkpoint));
+    int res;
+    if ((res = writeSuperblock()) != 0) { return res; }
+    if ((res = openSegment(0)) != 0) { return res; }
+    return logTree(root);
+}
+
+// the newest record of a shared id holds its contents; its references are
+// counted from the tables naming it
+int replayShared(struct record_header *header, const char *payload, off_t addr) {
+    if (header->length < sizeof(struct data_record)) { return -EIO; }
+    struct data_record record;
+    memcpy(&record, payload, sizeof(record));
+    if (record.block == 0 || record.block >= SHARED_PAGES * SHARED_PER_PAGE) { return -EIO; }
+    int res = growShared(record.block + 1);
+    if (res != 0) { return res; }
+    struct shared_block *current = sharedBlock(record.block);
+    current->block.addr = addr;
+    current->block.len = sizeof(struct record_header) + header->length;
+    current->block.flags = header->flags;
+    size_t length = header->length - sizeof(record);
+    if (!(header->flags & RECORD_COMPRESSED)) {
+        current->hash = hashBlock(payload + sizeof(record), length);
+        return 0;
+    }
+    char data[BLOCK_SIZE];
+    int unpacked = decompressBlock(payload + sizeof(record), length, data, sizeof(data));
+    if (unpacked < 0) { return unpacked; }
+    current->hash = hashBlock(data, unpacked);
+    return 0;
+}
+
+// free shared ids are not logged, they are the ones nothing refers to
+int indexShared() {
+    shared.free = 0;
+    shared.released = 0;
+    u_int32_t id;
+    for (id = shared.size; id-- > 1; ) {
+        struct shared_block *current = sharedBlock(id);
+        if (!current->refs) {
+            memset(&current->block, 0, sizeof(struct lfs_block));
+            current->next = shared.free;
+            shared.free = id;
+            continue;
+        }
+        if (linkShared(id) != 0) { return -EFAULT; }
+        shared.references += current->refs;
+        shared.referenced_bytes += (u_int64_t) current->refs * sharedLength(current);
+    }
+    return 0;
+}
+
+struct replay_entry {
+    char *inode;
+    size_t len;
+    off_t addr;
+    u_int32_t records;
+    struct LinkedListNode *node;
+};
+
+struct segment_order {
+    u_int64_t seq;
+    u_int32_t segment;
+};
+
+int compareSegments(const void *a, const void *b) {
+    const struct segment_order *x = a, *y = b;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+int replayRecord(struct replay_entry **table, size_t *table_size, struct record_header *header, const char *payload, off_t addr) {
+    if (header->type == RECORD_SHARED) { return replayShared(header, payload, addr); }
+    if (header->id < 0) { return 0; }
+    size_t id = header->id;
+    if (id >= *table_size) {
+        size_t new_size = (*table_size) ? *table_size : 64;
+        while (new_size <= id) { new_size *= 2; }
+        struct replay_entry *tmp = realloc(*table, new_size * sizeof(struct replay_entry));
+        if (!tmp) { return -EFAULT; }
+        memset(tmp + *table_size, 0, (new_size - *table_size) * sizeof(struct replay_entry));
+        *table = tmp;
+        *table_size = new_size;
+    }
+    struct replay_entry *entry = &(*table)[id];
+    if (header->type == RECORD_INODE) {
+        char *copy = malloc(header->length);
+        if (!copy) { return -EFAULT; }
+        memcpy(copy, payload, header->length);
+        free(entry->inode);
+        entry->inode = copy;
+        entry->len = header->length;
+        entry->addr = addr;
+    } else if (header->type == RECORD_DELETE) {
+        free(entry->inode);
+        entry->inode = NULL;
+        entry->addr = addr;
+    }
+    ++entry->records;
+    if (header->id >= CURRENT_ID) { CURRENT_ID = header->id + 1; }
+    return 0;
+}
+
+// reads the bytes of a data or shared record into buf, decompressed, which
+// holds a block and is left as it is past them
+int readStored(off_t addr, char *buf) {
+    struct record_header header;
+    int res = readAt(addr, &header, sizeof(header));
+    if (res != 0) { return res; }
+    if ((header.type != RECORD_DATA && header.type != RECORD_SHARED) || header.length < sizeof(struct data_record)) { return -EIO; }
+    char payload[sizeof(struct data_record) + BLOCK_SIZE];
+    if (header.length > sizeof(payload)) { return -EIO; }
+    if ((res = readAt(addr + sizeof(header), payload, header.length)) != 0) { return res; }
+    if (recordChecksum(&header, payload) != header.crc) { return -EIO; }
+    size_t stored = header.length - sizeof(struct data_record);
+    if (header.flags & RECORD_COMPRESSED) { return (decompressBlock(payload + sizeof(struct data_record), stored, buf, BLOCK_SIZE) < 0) ? -EIO : 0; }
+    memcpy(buf, payload + sizeof(struct data_record), stored);
+    return 0;
+}
+
+// faults a cold block back into memory
+int readBlock(struct lfs_block *block) {
+    char *data = allocData();
+    if (!data) { return -EFAULT; }
+    int res = readStored(block->addr, data);
+    if (res == 0) {
+        block->data = data;
+        block->flags |= BLOCK_REFERENCED;
+        __atomic_add_fetch(&memory.faults, 1, __ATOMIC_RELAXED);
+    } else { freeData(data); }
+    return res;
+}
+
+int readTable(struct lfs_entry *entry, size_t index, off_t addr) {
+    struct record_header header;
+    int res = readAt(addr, &header, sizeof(header));
+    if (res != 0) { return res; }
+    if (header.type != RECORD_INDIRECT || header.length < sizeof(struct indirect_record)) { return -EIO; }
+    char payload[sizeof(struct indirect_record) + BLOCKS_PER_TABLE * sizeof(struct block_pointer)];
+    if (header.length > sizeof(payload)) { return -EIO; }
+    if ((res = readAt(addr + sizeof(header), payload, header.length)) != 0) { return res; }
+    if (recordChecksum(&header, payload) != header.crc) { return -EIO; }
+    struct indirect_record record;
+    memcpy(&record, payload, sizeof(record));
+    if (record.count > BLOCKS_PER_TABLE || header.length < sizeof(record) + record.count * sizeof(struct block_pointer)) { return -EIO; }
+    struct block_table *table = calloc(1, sizeof(struct block_table));
+    if (!table) { return -EFAULT; }
+    entry->tables[index] = table;
+    table->addr = addr;
+    table->len = sizeof(header) + header.length;
+    u_int32_t i;
+    for (i = 0; i < record.count; ++i) {
+        struct block_pointer pointer;
+        memcpy(&pointer, payload + sizeof(record) + i * sizeof(pointer), sizeof(pointer));
+        if (pointer.shared && pointer.shared >= shared.size) {
+            entry->tables[index] = NULL;
+            free(table);
+            return -EIO;
+        }
+        table->blocks[i].addr = pointer.addr;
+        table->blocks[i].len = pointer.len;
+        table->blocks[i].flags = pointer.flags;
+        table->blocks[i].shared = pointer.shared;
+    }
+    for (i = 0; i < record.count; ++i) { entry->num_blocks += !isHole(&table->blocks[i]); }
+    return 0;
+}
+
+int readContents(struct lfs_entry *entry, const char *tables) {
+    size_t i;
+    for (i = 0; i < entry->num_tables; ++i) {
+        u_int64_t addr;
+        memcpy(&addr, tables + i * sizeof(addr), sizeof(addr));
+        int res;
+        if (addr != 0 && (res = readTable(entry, i, addr)) != 0) { return res; }
+    }
+    return 0;
+}
+
+void countBlocks(struct lfs_entry *entry) {
+    size_t i, j;
+    for (i = 0; i < entry->num_tables; ++i) {
+        struct block_table *table = entry->tables[i];
+        if (!table) { continue; }
+        disk_log.usage[segmentOf(table->addr)].live_bytes += table->len;
+        for (j = 0; j < BLOCKS_PER_TABLE; ++j) {
+            if (table->blocks[j].addr) { disk_log.usage[segmentOf(table->blocks[j].addr)].live_bytes += table->blocks[j].len; }
+            if (table->blocks[j].shared) { ++sharedBlock(table->blocks[j].shared)->refs; }
+        }
+    }
+}
+
+int buildTree(struct replay_entry *table, size_t table_size) {
+    size_t id;
+    for (id = 0; id < table_size; ++id) {
+        struct replay_entry *current = &table[id];
+        if (!current->inode || current->len < sizeof(struct inode_record)) { continue; }
+        struct inode_record record;
+        memcpy(&record, current->inode, sizeof(record));
+        if (current->len < sizeof(record) + record.name_len + record.num_tables * sizeof(u_int64_t)) { return -EIO; }
+        if (record.parent < 0 && id == ROOT_ID) {
+            current->node = root;
+        } else {
+            char name[FILENAME_SIZE];
+            size_t name_len = (record.name_len < FILENAME_SIZE) ? record.name_len : FILENAME_SIZE - 1;
+            memcpy(name, current->inode + sizeof(record), name_len);
+            name[name_len] = '\0';
+            if (!(current->node = allocNode(name, record.isFile, id))) { return -EFAULT; }
+        }
+        struct lfs_entry *entry = current->node->entry;
+        entry->actime = record.actime;
+        entry->modtime = record.modtime;
+        entry->generation = record.generation;
+        seenGeneration(record.generation);
+        if (record.isFile) {
+            entry->size = record.size;
+            if (record.num_tables > 0) {
+                if (!(entry->tables = calloc(record.num_tables, sizeof(struct block_table *)))) { return -EFAULT; }
+                entry->num_tables = record.num_tables;
+                entry->tables_capacity = record.num_tables;
+            }
+        }
+    }
+    for (id = 0; id < table_size; ++id) {
+        struct LinkedListNode *node = table[id].node;
+        if (!node || node == root) { continue; }
+        struct inode_record record;
+        memcpy(&record, table[id].inode, sizeof(record));
+        struct LinkedListNode *parent = ((size_t) record.parent < table_size) ? table[record.parent].node : NULL;
+        if (parent && !parent->entry->isFile && linkNode(parent, node) != 0) { return -EFAULT; }
+    }
+    for (id = 0; id < table_size; ++id) {
+        struct LinkedListNode *node = table[id].node;
+        if (!node) { continue; }
+        struct LinkedListNode *ancestor = node;
+        size_t depth = 0;
+        while (ancestor && ancestor != root && depth++ < table_size) { ancestor = ancestor->entry->parent; }
+        if (ancestor == root) { continue; }
+        printf("Dropping orphaned entry %s (id %ld)\n", node->name, (long) id);
+        freeNode(node);
+        table[id].node = NULL;
+    }
+    for (id = 0; id < table_size; ++id) {
+        struct LinkedListNode *node = table[id].node;
+        struct imap_entry *current = imapEntry(id);
+        if (!current) { return -EFAULT; }
+        current->records = table[id].records;
+        if (!node) {
+            if (table[id].inode || table[id].addr == 0 || table[id].records <= 1) { continue; }
+            current->addr = table[id].addr;
+            current->len = sizeof(struct record_header);
+            current->type = RECORD_DELETE;
+            disk_log.usage[segmentOf(current->addr)].live_bytes += current->len;
+            continue;
+        }
+        current->addr = table[id].addr;
+        current->len = sizeof(struct record_header) + table[id].len;
+        current->type = RECORD_INODE;
+        current->is_file = node->entry->isFile;
+        current->generation = node->entry->generation;
+        current->node = node;
+        disk_log.usage[segmentOf(current->addr)].live_bytes += current->len;
+        if (node->entry->isFile) {
+            struct inode_record record;
+            memcpy(&record, table[id].inode, sizeof(record));
+            int res = readContents(node->entry, table[id].inode + sizeof(record) + record.name_len);
+            if (res != 0) { return res; }
+            countBlocks(node->entry);
+            markDirSizes(node->entry->parent);
+        }
+    }
+    return 0;
+}
+
+// lazy mount methods
+int readInode(int id, struct inode_record *record, char **payload) {
+    struct record_header header;
+    int res = readAt(imap[id].addr, &header, sizeof(header));
+    if (res != 0) { return res; }
+    if (header.type != RECORD_INODE || header.length < sizeof(struct inode_record)) { return -EIO; }
+    if (!(*payload = malloc(header.length))) { return -EFAULT; }
+    res = readAt(imap[id].addr + sizeof(header), *payload, header.length);
+    if (res == 0 && recordChecksum(&header, *payload) != header.crc) { res = -EIO; }
+    if (res == 0) {
+        memcpy(record, *payload, sizeof(struct inode_record));
+        if (header.length < sizeof(struct inode_record) + record->name_len + record->num_tables * sizeof(u_int64_t)) { res = -EIO; }
+    }
+    if (res != 0) {
+        free(*payload);
+        *payload = NULL;
+    }
+    return res;
+}
+
+int loadNode(struct LinkedListNode *parent, int id) {
+    struct inode_record record;
+    char *payload;
+    int res = readInode(id, &record, &payload);
+    if (res != 0) { return res; }
+    char name[FILENAME_SIZE];
+    size_t name_len = (record.name_len < FILENAME_SIZE) ? record.name_len : FILENAME_SIZE - 1;
+    memcpy(name, payload + sizeof(record), name_len);
+    name[name_len] = '\0';
+    struct LinkedListNode *node = allocNode(name, record.isFile, id);
+    if (!node) {
+        free(payload);
+        return -EFAULT;
+    }
+    node->entry->actime = record.actime;
+    node->entry->modtime = record.modtime;
+    node->entry->generation = record.generation;
+    node->entry->size = imap[id].size;
+    if (!record.isFile) { node->entry->entries->loaded = (imap[id].first_child == 0); }
+    if (record.isFile && record.num_tables > 0) {
+        if (!(node->entry->tables = calloc(record.num_tables, sizeof(struct block_table *)))) {
+            res = -EFAULT;
+        } else {
+            node->entry->num_tables = record.num_tables;
+            node->entry->tables_capacity = record.num_tables;
+            res = readContents(node->entry, payload + sizeof(record) + record.name_len);
+        }
+    }
+    free(payload);
+    if (res == 0) { res = linkNode(parent, node); }
+    if (res != 0) {
+        freeNode(node);
+        return res;
+    }
+    imap[id].node = node;
+    return 0;
+}
+
+// materializes the children of a directory left unread by a checkpoint mount
+int loadDirectory(struct LinkedListNode *dir) {
+    struct LinkedList *list = dir->entry->entries;
+    if (__atomic_load_n(&list->loaded, __ATOMIC_ACQUIRE)) { return 0; }
+    pthread_rwlock_wrlock(&list->lock);
+    pthread_mutex_lock(&log_lock);
+    int res = 0;
+    if (!list->loaded && (size_t) dir->entry->id < imap_size) {
+        while (imap[dir->entry->id].first_child != 0 && res == 0) {
+            int id = imap[dir->entry->id].first_child;
+            if ((res = loadNode(dir, id)) == 0) { imap[dir->entry->id].first_child = imap[id].next_sibling; }
+        }
+    }
+    if (res == 0) { __atomic_store_n(&list->loaded, true, __ATOMIC_RELEASE); }
+    pthread_mutex_unlock(&log_lock);
+    pthread_rwlock_unlock(&list->lock);
+    return res;
+}
+
+// loads the directories down to an id; called without log_lock, which
+// loadDirectory takes after a list's lock
+struct LinkedListNode *faultNode(int id) {
+    pthread_mutex_lock(&log_lock);
+    struct imap_entry *current = &imap[id];
+    struct LinkedListNode *node = current->node;
+    int64_t parent = (!node && current->type == RECORD_INODE && current->parent >= 0 && (size_t) current->parent < imap_size) ? current->parent : -1;
+    pthread_mutex_unlock(&log_lock);
+    if (parent < 0) { return node; }
+    struct LinkedListNode *dir = faultNode(parent);
+    if (!dir || dir->entry->isFile || loadDirectory(dir) != 0) { return NULL; }
+    pthread_mutex_lock(&log_lock);
+    node = imap[id].node;
+    pthread_mutex_unlock(&log_lock);
+    return node;
+}
+
+// an entry unlinked while open holds its shared references in memory only,
+// the checkpoint leaves them and blocks only it refers to out
+void uncountUnlinked(struct shared_entry *entries, struct segment_usage *usage) {
+    size_t chunk, i, t, j;
+    for (chunk = 0; chunk < inodes.num_chunks; ++chunk) {
+        for (i = 0; inodes.chunks[chunk] && i < INODES_PER_CHUNK; ++i) {
+            struct lfs_entry *entry = &inodes.chunks[chunk]->inodes[i];
+            if (!entry->live || !entry->unlinked || !entry->isFile) { continue; }
+            for (t = 0; t < entry->num_tables; ++t) {
+                struct block_table *table = entry->tables[t];
+                for (j = 0; table && j < BLOCKS_PER_TABLE; ++j) {
+                    struct shared_entry *current = (table->blocks[j].shared) ? &entries[table->blocks[j].shared] : NULL;
+                    if (!current || current->refs == 0 || --current->refs > 0) { continue; }
+                    struct segment_usage *segment = &usage[segmentOf(current->addr)];
+                    segment->live_bytes = (segment->live_bytes > current->len) ? segment->live_bytes - current->len : 0;
+                    memset(current, 0, sizeof(struct shared_entry));
+                }
+            }
+        }
+    }
+}
+
+// the snapshot takes tree_lock exclusively only while it is built, and its
+// chunks are appended before log_lock is let go so that no record falls
+// between it and the tail it names; syncing and the superblock happen with
+// neither held. The usage table leaves out the chunks of the checkpoint being
+// replaced and has freed (a segment the cleaner is about to erase, or -1)
+// already free; loadCheckpoint counts the new chunks back in. Only the
+// cleaner, or unmount once it stopped, writes one, so segments are only held
+// by the writer itself
+int writeCheckpoint(int freed) {
+    if (disk_log.fd < 0) { return 0; }
+    pthread_rwlock_wrlock(&tree_lock);
+    dirSize(root);
+    pthread_mutex_lock(&log_lock);
+    size_t usage_len = disk_log.num_segments * sizeof(struct segment_usage);
+    size_t shared_start = usage_len + imap_size * sizeof(struct checkpoint_entry);
+    size_t len = shared_start + shared.size * sizeof(struct shared_entry);
+    size_t num_chunks = (len + MAX_RECORD_PAYLOAD - 1) / MAX_RECORD_PAYLOAD;
+    char *stream = (num_chunks <= MAX_CHECKPOINT_CHUNKS) ? malloc(len) : NULL;
+    if (!stream) {
+        pthread_mutex_unlock(&log_lock);
+        pthread_rwlock_unlock(&tree_lock);
+        return (num_chunks <= MAX_CHECKPOINT_CHUNKS) ? -EFAULT : 0;
+    }
+    memcpy(stream, disk_log.usage, usage_len);
+    struct segment_usage *usage = (struct segment_usage *) stream;
+    size_t i;
+    for (i = 0; i < disk_log.checkpoint.num_chunks; ++i) {
+        struct segment_usage *current = &usage[segmentOf(disk_log.chunks[i])];
+        current->live_bytes = (current->live_bytes > disk_log.chunk_len[i]) ? current->live_bytes - disk_log.chunk_len[i] : 0;
+    }
+    if (freed >= 0) {
+        usage[freed].state = SEGMENT_FREE;
+        usage[freed].live_bytes = 0;
+    }
+    for (i = 0; disk_log.held_segments && i < usage_len / sizeof(struct segment_usage); ++i) {
+        if (usage[i].state == SEGMENT_HELD) { usage[i].state = SEGMENT_FREE; }
+    }
+    size_t id;
+    for (id = 0; id < imap_size; ++id) {
+        struct imap_entry *current = &imap[id];
+        struct checkpoint_entry entry = { current->addr, current->len, current->records, current->parent, current->size, current->type, current->is_file, current->generation, 0 };
+        if (current->node) {
+            struct LinkedListNode *parent = current->node->entry->parent;
+            entry.parent = (parent) ? parent->entry->id : -1;
+            entry.size = current->node->entry->size;
+        }
+        memcpy(stream + usage_len + id * sizeof(entry), &entry, sizeof(entry));
+    }
+    for (id = 1; id < shared.size; ++id) {
+        struct shared_block *current = sharedBlock(id);
+        struct shared_entry entry = { current->block.addr, current->hash, current->block.len, current->block.flags & ~BLOCK_MEMORY_FLAGS, current->refs };
+        memcpy(stream + shared_start + id * sizeof(entry), &entry, sizeof(entry));
+    }
+    if (shared.size > 0) { memset(stream + shared_start, 0, sizeof(struct shared_entry)); }
+    uncountUnlinked((struct shared_entry *) (stream + shared_start), usage);
+    int next_id = CURRENT_ID;
+    pthread_rwlock_unlock(&tree_lock);
+    u_int64_t chunks[MAX_CHECKPOINT_CHUNKS];
+    u_int32_t chunk_len[MAX_CHECKPOINT_CHUNKS];
+    int res = 0;
+    for (i = 0; i < num_chunks && res == 0; ++i) {
+        size_t offset = i * MAX_RECORD_PAYLOAD;
+        size_t length = (len - offset < MAX_RECORD_PAYLOAD) ? len - offset : MAX_RECORD_PAYLOAD;
+        off_t addr;
+        res = appendRecord(RECORD_CHECKPOINT, 0, -1, stream + offset, length, &addr);
+        chunks[i] = addr;
+        chunk_len[i] = sizeof(struct record_header) + length;
+    }
+    free(stream);
+    struct lfs_superblock next = disk_log.checkpoint;
+    next.num_chunks = num_chunks;
+    next.checkpoint_segments = usage_len / sizeof(struct segment_usage);
+    next.segment_seq = disk_log.segment_seq;
+    next.record_seq = disk_log.record_seq;
+    next.tail = disk_log.tail;
+    next.imap_size = imap_size;
+    next.shared_size = shared.size;
+    next.current_segment = disk_log.current_segment;
+    next.next_id = next_id;
+    u_int32_t released = shared.released;
+    pthread_mutex_unlock(&log_lock);
+    if (res == 0) { res = flushLog(); }
+    if (res != 0) { return res; }
+    pthread_mutex_lock(&log_lock);
+    struct lfs_superblock previous = disk_log.checkpoint;
+    u_int64_t old_chunks[MAX_CHECKPOINT_CHUNKS];
+    u_int32_t old_len[MAX_CHECKPOINT_CHUNKS];
+    memcpy(old_chunks, disk_log.chunks, previous.num_chunks * sizeof(u_int64_t));
+    memcpy(old_len, disk_log.chunk_len, previous.num_chunks * sizeof(u_int32_t));
+    disk_log.checkpoint = next;
+    memcpy(disk_log.chunks, chunks, num_chunks * sizeof(u_int64_t));
+    memcpy(disk_log.chunk_len, chunk_len, num_chunks * sizeof(u_int32_t));
+    res = writeSuperblock();
+    pthread_mutex_unlock(&log_lock);
+    if (res == 0 && fdatasync(disk_log.fd) != 0) { res = -errno; }
+    pthread_mutex_lock(&log_lock);
+    if (res == 0) {
+        for (i = 0; i < previous.num_chunks; ++i) { releaseBytes(old_chunks[i], old_len[i]); }
+        for (i = 0; disk_log.held_segments && i < usage_len / sizeof(struct segment_usage); ++i) {
+            if (disk_log.usage[i].state != SEGMENT_HELD) { continue; }
+            disk_log.usage[i].state = SEGMENT_FREE;
+            ++disk_log.free_segments;
+            --disk_log.held_segments;
+        }
+        recycleShared(released);
+        disk_log.checkpoint_time = time(NULL);
+    } else {
+        disk_log.checkpoint = previous;
+        memcpy(disk_log.chunks, old_chunks, previous.num_chunks * sizeof(u_int64_t));
+        memcpy(disk_log.chunk_len, old_len, previous.num_chunks * sizeof(u_int32_t));
+    }
+    pthread_mutex_unlock(&log_lock);
+    return res;
+}
+
+// held segments make one due as well once writers run short of free segments
+// or the cleaner is done
+bool checkpointDue() {
+    pthread_mutex_lock(&log_lock);
+    bool due = disk_log.fd >= 0 && disk_log.record_seq > disk_log.checkpoint.record_seq && (u_int64_t) time(NULL) >= disk_log.checkpoint_time + config.checkpoint_interval;
+    if (disk_log.fd >= 0 && disk_log.held_segments && (disk_log.free_segments < config.clean_low || !cleaner.active)) { due = true; }
+    pthread_mutex_unlock(&log_lock);
+    return due;
+}
+
+// adds the bytes of a record to its segment's usage, or releases them unless
+// the segment was written after the checkpoint; those are counted from scratch
+void accountBytes(off_t addr, size_t bytes, int sign, const bool *fresh) {
+    if (addr == 0 || segmentOf(addr) >= disk_log.num_segments) { return; }
+    if (sign > 0) { disk_log.usage[segmentOf(addr)].live_bytes += bytes; }
+    else if (!fresh[segmentOf(addr)]) { releaseBytes(addr, bytes); }
+}
+
+// counts the bytes of every referenced shared block in or, unless the
+// segment was written after the checkpoint, out
+void accountShared(int sign, const bool *fresh) {
+    u_int32_t id;
+    for (id = 1; id < shared.size; ++id) {
+        struct shared_block *current = sharedBlock(id);
+        if (current->refs) { accountBytes(current->block.addr, current->block.len, sign, fresh); }
+    }
+}
+
+// accounts every record and shared reference the id's current state refers
+// to; a state that can no longer be read is only an error when it is being
+// counted in
+int accountNode(int id, int sign, const bool *fresh) {
+    struct imap_entry *current = &imap[id];
+    if (current->type != RECORD_INODE && current->type != RECORD_DELETE) { return 0; }
+    if (sign < 0 && current->addr && fresh[segmentOf(current->addr)]) { return 0; }
+    accountBytes(current->addr, current->len, sign, fresh);
+    if (current->type != RECORD_INODE || !current->is_file) { return 0; }
+    struct inode_record record;
+    char *payload;
+    int res = readInode(id, &record, &payload);
+    if (res != 0) { return (sign < 0) ? 0 : res; }
+    struct lfs_entry file;
+    memset(&file, 0, sizeof(file));
+    if (record.num_tables > 0 && !(file.tables = calloc(record.num_tables, sizeof(struct block_table *)))) {
+        free(payload);
+        return -EFAULT;
+    }
+    file.num_tables = record.num_tables;
+    res = readContents(&file, payload + sizeof(record) + record.name_len);
+    free(payload);
+    size_t i, j;
+    for (i = 0; i < file.num_tables; ++i) {
+        struct block_table *table = file.tables[i];
+        if (!table) { continue; }
+        accountBytes(table->addr, table->len, sign, fresh);
+        for (j = 0; j < BLOCKS_PER_TABLE; ++j) {
+            struct shared_block *referenced = (table->blocks[j].shared) ? sharedBlock(table->blocks[j].shared) : NULL;
+            accountBytes(table->blocks[j].addr, table->blocks[j].len, sign, fresh);
+            if (referenced && sign > 0) { ++referenced->refs; }
+            if (referenced && sign < 0 && referenced->refs > 0) { --referenced->refs; }
+        }
+    }
+    freeBlocks(&file);
+    return (sign < 0) ? 0 : res;
+}
+
+int replayForward(struct record_header *header, const char *payload, off_t addr, const bool *fresh, bool **touched, size_t *touched_size) {
+    if (header->type == RECORD_SHARED) { return replayShared(header, payload, addr); }
+    if (header->id < 0) { return 0; }
+    struct imap_entry *entry = imapEntry(header->id);
+    if (!entry) { return -EFAULT; }
+    if (imap_size > *touched_size) {
+        bool *tmp = realloc(*touched, imap_size * sizeof(bool));
+        if (!tmp) { return -EFAULT; }
+        memset(tmp + *touched_size, 0, (imap_size - *touched_size) * sizeof(bool));
+        *touched = tmp;
+        *touched_size = imap_size;
+    }
+    ++entry->records;
+    if (header->id >= CURRENT_ID) { CURRENT_ID = header->id + 1; }
+    if (header->type != RECORD_INODE && header->type != RECORD_DELETE) { return 0; }
+    if (header->type == RECORD_INODE && header->length < sizeof(struct inode_record)) { return -EIO; }
+    if (!(*touched)[header->id]) {
+        accountNode(header->id, -1, fresh);
+        (*touched)[header->id] = true;
+    }
+    entry->addr = addr;
+    entry->len = sizeof(struct record_header) + header->length;
+    entry->type = header->type;
+    if (header->type == RECORD_INODE) {
+        struct inode_record record;
+        memcpy(&record, payload, sizeof(record));
+        entry->parent = record.parent;
+        entry->size = record.size;
+        entry->is_file = record.isFile;
+        entry->generation = record.generation;
+        seenGeneration(record.generation);
+    }
+    return 0;
+}
+
+// directory sizes are not logged when a file below them changes
+void recomputeDirSizes() {
+    size_t id;
+    for (id = 0; id < imap_size; ++id) {
+        if (imap[id].type == RECORD_INODE && !imap[id].is_file) { imap[id].size = 0; }
+    }
+    for (id = 0; id < imap_size; ++id) {
+        if (imap[id].type != RECORD_INODE || !imap[id].is_file) { continue; }
+        int64_t parent = imap[id].parent;
+        size_t depth = 0;
+        while (parent >= 0 && (size_t) parent < imap_size && imap[parent].type == RECORD_INODE && depth++ < imap_size) {
+            imap[parent].size += imap[id].size;
+            parent = imap[parent].parent;
+        }
+    }
+}
+
+// replays what was appended after the checkpoint: its own segment past the
+// recorded tail, unless it was reused since, then every segment opened since,
+// in sequence order. Touched
+// ids have the bytes of their checkpointed state released and those of their
+// final state counted, shared blocks are counted again once their references
+// are. Segments past a torn record are erased
+int rollForward(struct lfs_superblock *sb) {
+    u_int32_t num_segments = disk_log.num_segments;
+    if (sb->current_segment >= num_segments) { return -EIO; }
+    bool *fresh = calloc(num_segments, sizeof(bool));
+    struct segment_order *order = malloc((num_segments + 1) * sizeof(struct segment_order));
+    char *buf = malloc(SEGMENT_SIZE);
+    bool *touched = NULL;
+    size_t touched_size = 0;
+    int res = (fresh && order && buf) ? 0 : -EFAULT;
+    u_int32_t count = 1;
+    u_int32_t i;
+    for (i = 0; i < num_segments && res == 0; ++i) {
+        struct segment_header header;
+        if (readAt(segmentStart(i), &header, sizeof(header)) != 0) { continue; }
+        u_int32_t crc = header.crc;
+        header.crc = 0;
+        if (header.magic != SEGMENT_MAGIC || checksum(0, &header, sizeof(header)) != crc || header.seq < sb->segment_seq) { continue; }
+        fresh[i] = true;
+        disk_log.usage[i].state = SEGMENT_DIRTY;
+        disk_log.usage[i].live_bytes = 0;
+        disk_log.usage[i].mtime = header.mtime;
+        order[count].seq = header.seq;
+        order[count].segment = i;
+        ++count;
+    }
+    if (count > 1) { qsort(order + 1, count - 1, sizeof(struct segment_order), compareSegments); }
+    if (res == 0) { accountShared(-1, fresh); }
+    bool resume = res == 0 && !fresh[sb->current_segment];
+    if (resume) {
+        order[0].seq = 0;
+        order[0].segment = sb->current_segment;
+    }
+    disk_log.current_segment = sb->current_segment;
+    disk_log.tail = sb->tail;
+    disk_log.segment_seq = sb->segment_seq;
+    disk_log.record_seq = sb->record_seq;
+    bool torn = false;
+    for (i = (resume) ? 0 : 1; i < count && res == 0; ++i) {
+        u_int32_t segment = order[i].segment;
+        off_t start = segmentStart(segment);
+        if (torn) {
+            struct segment_header blank;
+            memset(&blank, 0, sizeof(blank));
+            if ((res = writeAt(start, &blank, sizeof(blank))) != 0) { break; }
+            disk_log.usage[segment].state = SEGMENT_FREE;
+            fresh[segment] = false;
+            continue;
+        }
+        ssize_t got = pread(disk_log.fd, buf, SEGMENT_SIZE, start);
+        size_t pos = (i == 0) ? (size_t) (sb->tail - start) : sizeof(struct segment_header);
+        while (got > 0 && pos + sizeof(struct record_header) <= (size_t) got) {
+            struct record_header header;
+            memcpy(&header, buf + pos, sizeof(header));
+            if (header.type == RECORD_END || header.seq < disk_log.record_seq) { break; }
+            if (pos + sizeof(header) + header.length > (size_t) got || recordChecksum(&header, buf + pos + sizeof(header)) != header.crc) {
+                printf("Checksum mismatch in segment %u, ignoring the rest of the log\n", segment);
+                torn = true;
+                break;
+            }
+            if ((res = replayForward(&header, buf + pos + sizeof(header), start + pos, fresh, &touched, &touched_size)) != 0) { break; }
+            disk_log.record_seq = header.seq + 1;
+            pos += sizeof(header) + header.length;
+        }
+        if (i > 0) { disk_log.segment_seq = order[i].seq + 1; }
+        disk_log.current_segment = segment;
+        disk_log.tail = start + pos;
+    }
+    size_t id;
+    for (id = 0; id < touched_size && res == 0; ++id) {
+        if (touched[id]) { res = accountNode(id, 1, fresh); }
+    }
+    if (res == 0) { accountShared(1, fresh); }
+    if (res == 0 && touched_size > 0) { recomputeDirSizes(); }
+    free(touched);
+    free(buf);
+    free(order);
+    free(fresh);
+    return res;
+}
+
+// segments added after the checkpoint are past its usage table and start out free
+int loadCheckpoint(struct lfs_superblock *sb, const u_int64_t *chunks) {
+    if (sb->checkpoint_segments > sb->num_segments || sb->shared_size > SHARED_PAGES * SHARED_PER_PAGE) { return -EIO; }
+    size_t usage_len = sb->checkpoint_segments * sizeof(struct segment_usage);
+    size_t shared_start = usage_len + sb->imap_size * sizeof(struct checkpoint_entry);
+    size_t len = shared_start + sb->shared_size * sizeof(struct shared_entry);
+    char *stream = malloc(len);
+    if (!stream) { return -EFAULT; }
+    size_t pos = 0;
+    int res = 0;
+    u_int32_t i;
+    for (i = 0; i < sb->num_chunks && res == 0; ++i) {
+        struct record_header header;
+        if ((res = readAt(chunks[i], &header, sizeof(header))) != 0) { break; }
+        if (header.type != RECORD_CHECKPOINT || header.length > len - pos) {
+            res = -EIO;
+            break;
+        }
+        res = readAt(chunks[i] + sizeof(header), stream + pos, header.length);
+        if (res == 0 && recordChecksum(&header, stream + pos) != header.crc) { res = -EIO; }
+        disk_log.chunks[i] = chunks[i];
+        disk_log.chunk_len[i] = sizeof(header) + header.length;
+        pos += header.length;
+    }
+    if (res == 0 && pos != len) { res = -EIO; }
+    if (res == 0 && sb->imap_size > 0 && !imapEntry(sb->imap_size - 1)) { res = -EFAULT; }
+    if (res == 0) { res = growShared(sb->shared_size); }
+    if (res != 0) {
+        free(stream);
+        return res;
+    }
+    memcpy(disk_log.usage, stream, usage_len);
+    size_t id;
+    for (id = 0; id < sb->imap_size; ++id) {
+        struct checkpoint_entry entry;
+        memcpy(&entry, stream + usage_len + id * sizeof(entry), sizeof(entry));
+        imap[id].addr = entry.addr;
+        imap[id].len = entry.len;
+        imap[id].records = entry.records;
+        imap[id].type = entry.type;
+        imap[id].parent = entry.parent;
+        imap[id].size = entry.size;
+        imap[id].is_file = entry.is_file;
+        imap[id].generation = entry.generation;
+    }
+    for (id = 1; id < sb->shared_size; ++id) {
+        struct shared_entry entry;
+        memcpy(&entry, stream + shared_start + id * sizeof(entry), sizeof(entry));
+        struct shared_block *current = sharedBlock(id);
+        current->block.addr = entry.addr;
+        current->block.len = entry.len;
+        current->block.flags = entry.flags;
+        current->hash = entry.hash;
+        current->refs = entry.refs;
+    }
+    free(stream);
+    for (i = 0; i < sb->num_chunks; ++i) {
+        struct segment_usage *usage = &disk_log.usage[segmentOf(chunks[i])];
+        if (usage->state == SEGMENT_FREE) { usage->state = SEGMENT_DIRTY; }
+        usage->live_bytes += disk_log.chunk_len[i];
+    }
+    CURRENT_ID = sb->next_id;
+    ids.generation = sb->next_generation;
+    if ((res = rollForward(sb)) != 0) { return res; }
+    disk_log.free_segments = 0;
+    for (i = 0; i < disk_log.num_segments; ++i) {
+        struct segment_usage *usage = &disk_log.usage[i];
+        if (usage->state == SEGMENT_ACTIVE || usage->state == SEGMENT_CLEANING) { usage->state = SEGMENT_DIRTY; }
+        if (usage->state == SEGMENT_FREE) { ++disk_log.free_segments; }
+    }
+    if (disk_log.usage[disk_log.current_segment].state == SEGMENT_FREE) { --disk_log.free_segments; }
+    disk_log.usage[disk_log.current_segment].state = SEGMENT_ACTIVE;
+    disk_log.checkpoint = *sb;
+    disk_log.checkpoint_time = time(NULL);
+    for (id = imap_size; id-- > 0; ) {
+        struct imap_entry *current = &imap[id];
+        if (current->type != RECORD_INODE || current->parent < 0 || (size_t) current->parent >= imap_size) { continue; }
+        current->next_sibling = imap[current->parent].first_child;
+        imap[current->parent].first_child = id;
+    }
+
+    struct inode_record record;
+    char *payload;
+    if (imap_size == 0 || imap[ROOT_ID].type != RECORD_INODE) { return -EIO; }
+    if ((res = readInode(ROOT_ID, &record, &payload)) != 0) { return res; }
+    free(payload);
+    root->entry->actime = record.actime;
+    root->entry->modtime = record.modtime;
+    root->entry->generation = record.generation;
+    root->entry->size = imap[ROOT_ID].size;
+    root->entry->entries->loaded = (imap[ROOT_ID].first_child == 0);
+    imap[ROOT_ID].node = root;
+    return 0;
+}
+
+// replays every segment of the image, mapped read-only, in sequence order
+int scanLog(struct lfs_superblock *sb) {
+    struct stat st;
+    if (fstat(disk_log.fd, &st) != 0) { return -errno; }
+    char *image = NULL;
+    if (st.st_size > 0 && (image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, disk_log.fd, 0)) == MAP_FAILED) { return -errno; }
+    struct segment_order *order = malloc((sb->num_segments + 1) * sizeof(struct segment_order));
+    if (!order) {
+        if (image) { munmap(image, st.st_size); }
+        return -EFAULT;
+    }
+    u_int32_t count = 0;
+    u_int32_t i;
+    disk_log.free_segments = 0;
+    for (i = 0; i < sb->num_segments; ++i) {
+        struct segment_header header;
+        bool valid = segmentStart(i) + (off_t) sizeof(header) <= st.st_size;
+        if (valid) {
+            memcpy(&header, image + segmentStart(i), sizeof(header));
+            u_int32_t crc = header.crc;
+            header.crc = 0;
+            valid = header.magic == SEGMENT_MAGIC && checksum(0, &header, sizeof(header)) == crc;
+        }
+        if (!valid) { 
+            ++disk_log.free_segments;
+            continue; 
+        }
+        disk_log.usage[i].state = SEGMENT_DIRTY;
+        disk_log.usage[i].mtime = header.mtime;
+        order[count].seq = header.seq;
+        order[count].segment = i;
+        ++count;
+    }
+    qsort(order, count, sizeof(struct segment_order), compareSegments);
+
+    struct replay_entry *table = NULL;
+    size_t table_size = 0;
+    int res = 0;
+    disk_log.segment_seq = 1;
+    disk_log.record_seq = 1;
+    disk_log.current_segment = 0;
+    disk_log.tail = segmentStart(0) + sizeof(struct segment_header);
+    for (i = 0; i < count && res == 0; ++i) {
+        off_t start = segmentStart(order[i].segment);
+        const char *segment = image + start;
+        size_t got = (st.st_size - start < SEGMENT_SIZE) ? st.st_size - start : SEGMENT_SIZE;
+        size_t pos = sizeof(struct segment_header);
+        while (pos + sizeof(struct record_header) <= got) {
+            struct record_header header;
+            memcpy(&header, segment + pos, sizeof(header));
+            if (header.type == RECORD_END || pos + sizeof(header) + header.length > got) { break; }
+            if (recordChecksum(&header, segment + pos + sizeof(header)) != header.crc) {
+                printf("Checksum mismatch in segment %u, ignoring its tail\n", order[i].segment);
+                break;
+            }
+            if ((res = replayRecord(&table, &table_size, &header, segment + pos + sizeof(header), start + pos)) != 0) { break; }
+            if (header.seq >= disk_log.record_seq) { disk_log.record_seq = header.seq + 1; }
+            pos += sizeof(header) + header.length;
+        }
+        disk_log.segment_seq = order[i].seq + 1;
+        disk_log.current_segment = order[i].segment;
+        disk_log.tail = start + pos;
+    }
+    if (image) { munmap(image, st.st_size); }
+    free(order);
+    if (count > 0) { disk_log.usage[disk_log.current_segment].state = SEGMENT_ACTIVE; }
+    if (res == 0) { res = buildTree(table, table_size); }
+    if (res == 0) { accountShared(1, NULL); }
+    size_t id;
+    for (id = 0; id < table_size; ++id) { free(table[id].inode); }
+    free(table);
+    if (res == 0 && count == 0) { res = openNextSegment(); }
+    return res;
+}
+
+int loadLog() {
+    char buf[SUPERBLOCK_SIZE];
+    struct lfs_superblock sb;
+    if (readAt(0, buf, sizeof(buf)) != 0) { return 1; }
+    memcpy(&sb, buf, sizeof(sb));
+    if (sb.magic != LFS_MAGIC) { return 1; }
+    // before the crc, whose coverage another version may lay out differently
+    if (sb.version != LFS_VERSION) {
+        printf("Unsupported image version %u in disk.img, this build reads version %u; reformat by moving disk.img aside\n", sb.version, LFS_VERSION);
+        return -EINVAL;
+    }
+    if (sb.num_chunks > MAX_CHECKPOINT_CHUNKS) { return -EIO; }
+    u_int64_t chunks[MAX_CHECKPOINT_CHUNKS];
+    memcpy(chunks, buf + sizeof(sb), sb.num_chunks * sizeof(u_int64_t));
+    u_int32_t crc = sb.crc;
+    sb.crc = 0;
+    if (checksum(checksum(0, &sb, sizeof(sb)), chunks, sb.num_chunks * sizeof(u_int64_t)) != crc) { return -EIO; }
+    if (sb.segment_size != SEGMENT_SIZE || sb.block_size != BLOCK_SIZE) {
+        printf("Unsupported geometry in disk.img (%u byte segments, %u byte blocks), this build uses %u and %u; reformat by moving disk.img aside\n",
+            sb.segment_size, sb.block_size, SEGMENT_SIZE, BLOCK_SIZE);
+        return -EINVAL;
+    }
+    disk_log.num_segments = 0;
+    if (growUsage(sb.num_segments) != 0) { return -EFAULT; }
+    if (sb.num_chunks > 0) {
+        int res = loadCheckpoint(&sb, chunks);
+        if (res == 0) { return 0; }
+        printf("Checkpoint unreadable, scanning the log\n");
+        memset(disk_log.usage, 0, disk_log.num_segments * sizeof(struct segment_usage));
+        if (imap) { memset(imap, 0, imap_size * sizeof(struct imap_entry)); }
+        freeShared();
+        memset(&disk_log.checkpoint, 0, sizeof(disk_log.checkpoint));
+    }
+    ids.generation = sb.next_generation;
+    int res = scanLog(&sb);
+    if (res == 0 && sb.num_chunks > 0) { res = writeSuperblock(); }
+    return res;
+}
+
+// a legacy image is empty or a '|' separated dump that starts with the root
+bool legacyImage(int fd) {
+    char head[3];
+    ssize_t got = pread(fd, head, sizeof(head), 0);
+    return got == 0 || (got == (ssize_t) sizeof(head) && memcmp(head, "|/|", sizeof(head)) == 0);
+}
+
+// anything without a superblock that is not a legacy image either is taken
+// for a log whose superblock is damaged and left alone, as converting it
+// would truncate the log
+int mountLog() {
+    if ((disk_log.fd = open(DISK_PATH, O_RDWR)) < 0) {
+        if (errno != ENOENT) { return -errno; }
+        printf("Disk.img file does not exists - creating empty one\n");
+        return formatLog();
+    }
+    int res = loadLog();
+    if (res != 1) { return res; }
+    bool legacy = legacyImage(disk_log.fd);
+    close(disk_log.fd);
+    disk_log.fd = -1;
+    if (!legacy) {
+        printf("disk.img has no readable superblock and is not a legacy image; not mounting it\n");
+        return -EIO;
+    }
+    if ((res = loadFromDisk()) != 0) { return res; }
+    printf("Converting disk.img to the segment log format\n");
+    return formatLog();
+}
+
+// free ids are not logged, they are the ids below CURRENT_ID without a live
+// inode record
+int loadFreeIds() {
+    int id;
+    for (id = 0; id < CURRENT_ID; ++id) {
+        if (id == ROOT_ID || ((size_t) id < imap_size && imap[id].type == RECORD_INODE)) { continue; }
+        if (releaseId(id) != 0) { return -EFAULT; }
+    }
+    return 0;
+}
+
+void unmountLog() {
+    if (disk_log.fd < 0) { return; }
+    close(disk_log.fd);
+    disk_log.fd = -1;
+    free(disk_log.usage);
+    disk_log.usage = NULL;
+    free(imap);
+    imap = NULL;
+    imap_size = 0;
+    freeShared();
+}
+
+// cleaner methods
+double segmentBenefit(u_int32_t segment, u_int64_t now) {
+    struct segment_usage *usage = &disk_log.usage[segment];
+    double utilization = (double) usage->live_bytes / SEGMENT_SIZE;
+    u_int64_t age = (now > usage->mtime) ? now - usage->mtime : 0;
+    return (1.0 - utilization) * (age + 1) / (1.0 + utilization);
+}
+
+int pickVictim() {
+    u_int64_t now = time(NULL);
+    int victim = -1;
+    double best = 0;
+    u_int32_t segment;
+    for (segment = 0; segment < disk_log.num_segments; ++segment) {
+        struct segment_usage *usage = &disk_log.usage[segment];
+        if (usage->state != SEGMENT_DIRTY) { continue; }
+        if (usage->live_bytes > CLEAN_MAX_UTILIZATION * SEGMENT_SIZE) { continue; }
+        double benefit = segmentBenefit(segment, now);
+        if (victim < 0 || benefit > best) {
+            victim = segment;
+            best = benefit;
+        }
+    }
+    return victim;
+}
+
+int markDirty(struct dirty_list *dirty, int id) {
+    size_t i;
+    for (i = 0; i < dirty->count; ++i) {
+        if (dirty->ids[i] == id) { return 0; }
+    }
+    if (dirty->count == dirty->capacity) {
+        size_t capacity = (dirty->capacity) ? dirty->capacity * 2 : 16;
+        int *tmp = realloc(dirty->ids, capacity * sizeof(int));
+        if (!tmp) { return -EFAULT; }
+        dirty->ids = tmp;
+        dirty->capacity = capacity;
+    }
+    dirty->ids[dirty->count++] = id;
+    return 0;
+}
+
+// a tombstone newer than the checkpoint has to outlive the records it
+// deletes, roll-forward would bring the checkpointed inode back otherwise
+bool tombstoneNeeded(u_int64_t seq) { return disk_log.checkpoint.num_chunks > 0 && seq >= disk_log.checkpoint.record_seq; }
+
+// a shared block is copied under its id now and repointed by repointShared,
+// the tables naming it stay as they are
+int relocateShared(struct record_header *header, const char *payload, off_t addr, struct dirty_list *dirty) {
+    if (header->length < sizeof(struct data_record)) { return 0; }
+    struct data_record record;
+    memcpy(&record, payload, sizeof(record));
+    if (record.block == 0 || record.block >= shared.size) { return 0; }
+    struct shared_block *current = sharedBlock(record.block);
+    if (!current->refs || current->block.addr != addr) { return 0; }
+    if (dirty->num_moved == dirty->moved_capacity) {
+        size_t capacity = (dirty->moved_capacity) ? dirty->moved_capacity * 2 : 16;
+        struct moved_shared *tmp = realloc(dirty->moved, capacity * sizeof(struct moved_shared));
+        if (!tmp) { return -EFAULT; }
+        dirty->moved = tmp;
+        dirty->moved_capacity = capacity;
+    }
+    off_t new_addr;
+    int res = appendRecord(RECORD_SHARED, header->flags, -1, payload, header->length, &new_addr);
+    if (res == 0) { dirty->moved[dirty->num_moved++] = (struct moved_shared) { record.block, current->block.len, addr, new_addr }; }
+    return res;
+}
+
+// readers of a shared block hold no lock the cleaner could take, so the copies
+// are swapped in under tree_lock held exclusively, which also waits for any
+// reader of an old copy to finish. A block dropped meanwhile loses its copy
+void repointShared(struct dirty_list *dirty) {
+    pthread_rwlock_wrlock(&tree_lock);
+    pthread_mutex_lock(&log_lock);
+    size_t i;
+    for (i = 0; i < dirty->num_moved; ++i) {
+        struct moved_shared *moved = &dirty->moved[i];
+        struct shared_block *current = sharedBlock(moved->id);
+        if (current->refs && current->block.addr == moved->from) { current->block.addr = moved->to; }
+        else { releaseBytes(moved->to, moved->len); }
+    }
+    pthread_mutex_unlock(&log_lock);
+    pthread_rwlock_unlock(&tree_lock);
+}
+
+// a data block is copied and an indirect table marked dirty under the owner's
+// lock, which is all a callback changing them holds besides tree_lock
+int relocateBlock(struct record_header *header, const char *payload, off_t addr, struct dirty_list *dirty) {
+    struct LinkedListNode *node = faultNode(header->id);
+    if (!node || !node->entry->isFile) { return 0; }
+    struct lfs_entry *file = node->entry;
+    pthread_rwlock_wrlock(&file->lock);
+    pthread_mutex_lock(&log_lock);
+    int res = 0;
+    if (header->type == RECORD_INDIRECT && header->length >= sizeof(struct indirect_record)) {
+        struct indirect_record record;
+        memcpy(&record, payload, sizeof(record));
+        if (record.index < file->num_tables && file->tables[record.index] && file->tables[record.index]->addr == addr) {
+            file->tables[record.index]->dirty = true;
+            res = markDirty(dirty, header->id);
+        }
+    } else if (header->type == RECORD_DATA && header->length >= sizeof(struct data_record)) {
+        struct data_record record;
+        memcpy(&record, payload, sizeof(record));
+        struct lfs_block *block = getBlock(file, record.block, false);
+        off_t new_addr;
+        if (block && block->addr == addr && (res = appendRecord(RECORD_DATA, header->flags, header->id, payload, header->length, &new_addr)) == 0) {
+            block->addr = new_addr;
+            file->tables[record.block / BLOCKS_PER_TABLE]->dirty = true;
+            res = markDirty(dirty, header->id);
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+    pthread_rwlock_unlock(&file->lock);
+    return res;
+}
+
+// live inodes and indirect tables are marked dirty and written again from
+// memory once the victim is scanned, everything else is copied as it is; a
+// victim holding the current checkpoint gets a new one written instead
+int relocateRecord(struct record_header *header, const char *payload, off_t addr, struct dirty_list *dirty) {
+    if (header->type == RECORD_DATA || header->type == RECORD_INDIRECT) {
+        if (header->id < 0) { return 0; }
+        pthread_mutex_lock(&log_lock);
+        bool owned = (size_t) header->id < imap_size && imap[header->id].type == RECORD_INODE;
+        pthread_mutex_unlock(&log_lock);
+        return (owned) ? relocateBlock(header, payload, addr, dirty) : 0;
+    }
+    pthread_mutex_lock(&log_lock);
+    int res = 0;
+    off_t new_addr;
+    struct imap_entry *entry = (header->id >= 0 && (size_t) header->id < imap_size) ? &imap[header->id] : NULL;
+    if (header->type == RECORD_CHECKPOINT) {
+        u_int32_t i;
+        for (i = 0; i < disk_log.checkpoint.num_chunks; ++i) {
+            if (disk_log.chunks[i] == (u_int64_t) addr) { dirty->checkpoint = true; }
+        }
+    } else if (header->type == RECORD_SHARED) {
+        res = relocateShared(header, payload, addr, dirty);
+    } else if (header->type == RECORD_INODE && entry && entry->addr == addr) {
+        if (entry->node) { res = markDirty(dirty, header->id); }
+        else if ((res = appendRecord(header->type, header->flags, header->id, payload, header->length, &new_addr)) == 0) { entry->addr = new_addr; }
+    } else if (header->type == RECORD_DELETE && entry && entry->addr == addr && !entry->node && (entry->records > 1 || tombstoneNeeded(header->seq))) {
+        if ((res = appendRecord(header->type, header->flags, header->id, payload, header->length, &new_addr)) == 0) { entry->addr = new_addr; }
+    }
+    pthread_mutex_unlock(&log_lock);
+    return res;
+}
+
+void forgetRecord(struct record_header *header) {
+    if (header->id < 0 || (size_t) header->id >= imap_size) { return; }
+    struct imap_entry *entry = &imap[header->id];
+    if (entry->records > 0) { --entry->records; }
+    struct record_header tombstone;
+    if (entry->type == RECORD_DELETE && entry->records <= 1 && readAt(entry->addr, &tombstone, sizeof(tombstone)) == 0 && !tombstoneNeeded(tombstone.seq)) {
+        releaseBytes(entry->addr, entry->len);
+        entry->addr = 0;
+        entry->len = 0;
+        entry->type = RECORD_END;
+    }
+}
+
+// runs under tree_lock held shared, which keeps the records' owners from being
+// freed; each record moves under its owner's lock. The copies are synced and
+// the victim erased with the tree unlocked. A victim written before the last
+// checkpoint is held rather than freed unless it gets a new one
+int cleanSegment(u_int32_t segment, char *buf) {
+    off_t start = segmentStart(segment);
+    memset(buf, 0, SEGMENT_SIZE);
+    ssize_t got = pread(disk_log.fd, buf, SEGMENT_SIZE, start);
+    struct dirty_list dirty = { NULL, 0, 0, false, NULL, 0, 0 };
+    int res = (got < 0) ? -EIO : 0;
+    size_t pos = sizeof(struct segment_header);
+    pthread_rwlock_rdlock(&tree_lock);
+    while (res == 0 && pos + sizeof(struct record_header) <= (size_t) got) {
+        struct record_header header;
+        memcpy(&header, buf + pos, sizeof(header));
+        if (header.type == RECORD_END || pos + sizeof(header) + header.length > (size_t) got) { break; }
+        if (recordChecksum(&header, buf + pos + sizeof(header)) != header.crc) { break; }
+        res = relocateRecord(&header, buf + pos + sizeof(header), start + pos, &dirty);
+        pos += sizeof(header) + header.length;
+    }
+    size_t i;
+    for (i = 0; i < dirty.count && res == 0; ++i) {
+        pthread_mutex_lock(&log_lock);
+        struct LinkedListNode *node = imap[dirty.ids[i]].node;
+        pthread_mutex_unlock(&log_lock);
+        if (node && !node->entry->isFile) { dirSize(node); }
+        if (node) { res = logEntry(node); }
+    }
+    pthread_rwlock_unlock(&tree_lock);
+    if (dirty.num_moved > 0) { repointShared(&dirty); }
+    if (res == 0 && dirty.checkpoint) { res = writeCheckpoint(segment); }
+    struct segment_header blank;
+    memset(&blank, 0, sizeof(blank));
+    if (res == 0) { res = flushLog(); }
+    if (res == 0) { res = writeAt(start, &blank, sizeof(blank)); }
+    pthread_mutex_lock(&log_lock);
+    if (res == 0) {
+        size_t end = pos;
+        for (pos = sizeof(struct segment_header); pos < end; ) {
+            struct record_header header;
+            memcpy(&header, buf + pos, sizeof(header));
+            forgetRecord(&header);
+            pos += sizeof(header) + header.length;
+        }
+        struct segment_header victim;
+        memcpy(&victim, buf, sizeof(victim));
+        bool held = !dirty.checkpoint && disk_log.checkpoint.num_chunks > 0 && victim.seq < disk_log.checkpoint.segment_seq;
+        disk_log.usage[segment].state = (held) ? SEGMENT_HELD : SEGMENT_FREE;
+        disk_log.usage[segment].live_bytes = 0;
+        if (held) { ++disk_log.held_segments; } else { ++disk_log.free_segments; }
+    } else { disk_log.usage[segment].state = SEGMENT_DIRTY; }
+    pthread_mutex_unlock(&log_lock);
+    free(dirty.ids);
+    free(dirty.moved);
+    return res;
+}
+
+// a resident block can go once the image holds its record; a dirty one is
+// not logged yet
+bool evictable(struct lfs_block *block) {
+    if (!block->data || !block->addr || (block->flags & BLOCK_DIRTY)) { return false; }
+    return segmentOf(block->addr) != disk_log.current_segment || block->addr + block->len <= disk_log.flushed;
+}
+
+// second chance: a block used since the hand last passed it loses its mark
+// and stays
+void sweepBlock(struct lfs_block *block) {
+    if (!evictable(block)) { return; }
+    if (block->flags & BLOCK_REFERENCED) {
+        block->flags &= ~BLOCK_REFERENCED;
+        return;
+    }
+    freeData(block->data);
+    block->data = NULL;
+    ++memory.evictions;
+}
+
+// drops block buffers until an eighth of the budget is free, files first as
+// a shared block may serve several; each hand goes round at most twice.
+// Files unlinked while open keep their blocks, those live in memory only.
+// Files are swept under tree_lock held shared, which keeps a node the imap
+// names in place, and each under its own lock. Readers of a shared block hold
+// only the lock of a file naming it, so those are swept with the tree locked
+// exclusively, which costs no more than freeing their buffers
+void evictBlocks() {
+    u_int64_t target = memoryBudget() - memoryBudget() / 8;
+    u_int64_t steps;
+    pthread_rwlock_rdlock(&tree_lock);
+    pthread_mutex_lock(&log_lock);
+    u_int64_t files = imap_size;
+    pthread_mutex_unlock(&log_lock);
+    for (steps = 0; steps < 2 * files && __atomic_load_n(&memory.resident, __ATOMIC_RELAXED) > target; ++steps) {
+        pthread_mutex_lock(&log_lock);
+        if ((size_t) memory.file_hand >= imap_size) { memory.file_hand = 0; }
+        struct LinkedListNode *node = (imap_size) ? imap[memory.file_hand++].node : NULL;
+        pthread_mutex_unlock(&log_lock);
+        if (!node || !node->entry->isFile) { continue; }
+        struct lfs_entry *entry = node->entry;
+        pthread_rwlock_wrlock(&entry->lock);
+        pthread_mutex_lock(&log_lock);
+        size_t i, j;
+        for (i = 0; i < entry->num_tables; ++i) {
+            for (j = 0; entry->tables[i] && j < BLOCKS_PER_TABLE; ++j) { sweepBlock(&entry->tables[i]->blocks[j]); }
+        }
+        pthread_mutex_unlock(&log_lock);
+        pthread_rwlock_unlock(&entry->lock);
+    }
+    pthread_rwlock_unlock(&tree_lock);
+    if (__atomic_load_n(&memory.resident, __ATOMIC_RELAXED) <= target) { return; }
+    pthread_rwlock_wrlock(&tree_lock);
+    pthread_mutex_lock(&log_lock);
+    for (steps = 0; steps < 2 * (u_int64_t) shared.size && __atomic_load_n(&memory.resident, __ATOMIC_RELAXED) > target; ++steps) {
+        if (memory.shared_hand == 0 || memory.shared_hand >= shared.size) { memory.shared_hand = 1; }
+        struct shared_block *current = sharedBlock(memory.shared_hand++);
+        if (current->refs) { sweepBlock(&current->block); }
+    }
+    pthread_mutex_unlock(&log_lock);
+    pthread_rwlock_unlock(&tree_lock);
+}
+
+void *cleanerThread(void *arg) {
+    char *buf = malloc(SEGMENT_SIZE);
+    if (!buf) { return NULL; }
+    pthread_mutex_lock(&cleaner.lock);
+    while (!cleaner.stop) {
+        pthread_mutex_unlock(&cleaner.lock);
+        pthread_mutex_lock(&log_lock);
+        if (disk_log.free_segments + disk_log.held_segments < config.clean_low) { cleaner.active = true; }
+        if (disk_log.free_segments + disk_log.held_segments >= config.clean_high) { cleaner.active = false; }
+        int victim = (cleaner.active) ? pickVictim() : -1;
+        if (victim >= 0) { disk_log.usage[victim].state = SEGMENT_CLEANING; }
+        pthread_mutex_unlock(&log_lock);
+        if (victim >= 0 && cleanSegment(victim, buf) != 0) { victim = -1; }
+        if (checkpointDue() && writeCheckpoint(-1) != 0) { printf("Failed to write a checkpoint\n"); }
+        if (overBudget()) { evictBlocks(); }
+        pthread_mutex_lock(&cleaner.lock);
+        if (victim < 0 && !cleaner.stop) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += CLEAN_INTERVAL;
+            pthread_cond_timedwait(&cleaner.wake, &cleaner.lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&cleaner.lock);
+    free(buf);
+    return NULL;
+}
+
+void startCleaner() {
+    if (cleaner.running) { return; }
+    cleaner.stop = false;
+    cleaner.active = false;
+    if (pthread_create(&cleaner.thread, NULL, cleanerThread, NULL) == 0) { cleaner.running = true; }
+}
+
+void stopCleaner() {
+    if (!cleaner.running) { return; }
+    pthread_mutex_lock(&cleaner.lock);
+    cleaner.stop = true;
+    pthread_cond_signal(&cleaner.wake);
+    pthread_mutex_unlock(&cleaner.lock);
+    pthread_join(cleaner.thread, NULL);
+    cleaner.running = false;
+}
+
+// flusher methods
+void *flusherThread(void *arg) {
+    pthread_mutex_lock(&flusher.lock);
+    while (!flusher.stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += config.commit_interval / 1000;
+        deadline.tv_nsec += (long) (config.commit_interval % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&flusher.wake, &flusher.lock, &deadline);
+        pthread_mutex_unlock(&flusher.lock);
+        if (flushLog() != 0) { printf("Failed to commit the log\n"); }
+        pthread_mutex_lock(&flusher.lock);
+    }
+    pthread_mutex_unlock(&flusher.lock);
+    return NULL;
+}
+
+void startFlusher() {
+    if (flusher.running || config.durable) { return; }
+    char *wbuf = malloc(SEGMENT_SIZE);
+    if (!wbuf) { return; }
+    pthread_mutex_lock(&log_lock);
+    disk_log.flushed = disk_log.tail;
+    disk_log.wbuf = wbuf;
+    pthread_mutex_unlock(&log_lock);
+    flusher.stop = false;
+    if (pthread_create(&flusher.thread, NULL, flusherThread, NULL) == 0) { 
+        flusher.running = true; 
+        return;
+    }
+    pthread_mutex_lock(&log_lock);
+    disk_log.wbuf = NULL;
+    pthread_mutex_unlock(&log_lock);
+    free(wbuf);
+}
+
+// commits what is still buffered and goes back to writing records through
+void stopFlusher() {
+    if (!flusher.running) { return; }
+    pthread_mutex_lock(&flusher.lock);
+    flusher.stop = true;
+    pthread_cond_signal(&flusher.wake);
+    pthread_mutex_unlock(&flusher.lock);
+    pthread_join(flusher.thread, NULL);
+    flusher.running = false;
+    if (flushLog() != 0) { printf("Failed to commit the log\n"); }
+    pthread_mutex_lock(&log_lock);
+    free(disk_log.wbuf);
+    disk_log.wbuf = NULL;
+    pthread_mutex_unlock(&log_lock);
+}
+
+// node methods; these back both the path and the low-level callbacks and are
+// called with tree_lock held, exclusively where noted
+void statNode(struct LinkedListNode *current, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    if (current->entry->isFile) {
+        stbuf->st_mode = S_IFREG | 0777;
+        stbuf->st_nlink = 1;
+    } else {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+    }
+    size_t size = (current->entry->isFile) ? 0 : dirSize(current);
+    pthread_rwlock_rdlock(&current->entry->lock);
+    stbuf->st_ino = ((u_int64_t) current->entry->generation << 32) | (u_int32_t) current->entry->id;
+    stbuf->st_size = (current->entry->isFile) ? current->entry->size : size;
+    stbuf->st_blocks = current->entry->num_blocks * (BLOCK_SIZE / 512);
+    stbuf->st_atime = current->entry->actime;
+    stbuf->st_mtime = current->entry->modtime;
+    pthread_rwlock_unlock(&current->entry->lock);
+}
+
+// exclusive
+int removeDir(struct LinkedListNode *current) {
+    int res = (!current->entry->isFile && loadDirectory(current) != 0) ? -EIO : 0;
+    if (res == 0 && !current->entry->isFile && current->entry->entries->num_entries != 0) { res = -ENOTEMPTY; }
+    if (res == 0) { res = logDelete(current); }
+    if (res == 0) { res = rmThisEntry(current); }
+    return res;
+}
+
+// exclusive
+int removeFile(struct LinkedListNode *current) {
+    int res = logDelete(current);
+    if (res == 0) { res = rmThisEntry(current); }
+    return res;
+}
+
+int truncateNode(struct LinkedListNode *current, off_t offset) {
+    if (!current->entry->isFile) { return -EISDIR; }
+    pthread_rwlock_wrlock(&current->entry->lock);
+    size_t oldSize = current->entry->size;
+    int res = 0;
+    current->entry->size = offset;
+    current->entry->data_changed = true;
+    if (offset == 0) {
+        current->entry->samples = 0;
+        current->entry->incompressible = false;
+    }
+    if ((size_t) offset < oldSize && (res = trimBlocks(current->entry, offset)) > 0) { res = (current->entry->unlinked) ? 0 : logBlocks(current->entry, offset, 1); }
+    if (res == 0 && !current->entry->unlinked) { res = logInode(current); }
+    pthread_rwlock_unlock(&current->entry->lock);
+    if ((size_t) offset != oldSize) { markDirSizes(current->entry->parent); }
+    return res;
+}
+
+// the log takes space as blocks are written, there is none to reserve, so
+// allocating only moves the end of the file. Punching and zeroing leave holes
+int fallocateNode(struct LinkedListNode *current, int mode, off_t offset, off_t length) {
+    if (!current->entry->isFile) { return -EISDIR; }
+    if (offset < 0 || length <= 0) { return -EINVAL; }
+    if (offset > INT64_MAX - length) { return -EFBIG; }
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) { return -EOPNOTSUPP; }
+    bool punch = mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE);
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && (!(mode & FALLOC_FL_KEEP_SIZE) || (mode & FALLOC_FL_ZERO_RANGE))) { return -EOPNOTSUPP; }
+    pthread_rwlock_wrlock(&current->entry->lock);
+    size_t oldSize = current->entry->size;
+    size_t end = offset + length;
+    int res = (punch) ? punchBlocks(current->entry, offset, end) : 0;
+    if (res == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && end > oldSize) { current->entry->size = end; }
+    bool changed = punch || current->entry->size != oldSize;
+    if (changed) {
+        current->entry->modtime = time(NULL);
+        current->entry->data_changed = true;
+    }
+    if (res == 0 && changed && !current->entry->unlinked) { res = logInode(current); }
+    size_t newSize = current->entry->size;
+    pthread_rwlock_unlock(&current->entry->lock);
+    if (newSize != oldSize) { markDirSizes(current->entry->parent); }
+    return res;
+}
+
+// the data of a file as "offset length" lines, the gaps between them are
+// holes. The path API of FUSE 2.9 has no lseek, so SEEK_DATA and SEEK_HOLE
+// find no holes; this answers them instead. Size 0 asks for the length only
+int readExtents(struct lfs_entry *entry, char *value, size_t size) {
+    if (!entry->isFile) { return -ENODATA; }
+    pthread_rwlock_rdlock(&entry->lock);
+    size_t blocks = (entry->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t len = 0, index = 0;
+    while (index < blocks) {
+        if (index / BLOCKS_PER_TABLE >= entry->num_tables) { break; }
+        if (!entry->tables[index / BLOCKS_PER_TABLE]) { 
+            index = (index / BLOCKS_PER_TABLE + 1) * BLOCKS_PER_TABLE;
+            continue;
+        }
+        if (isHole(getBlock(entry, index, false))) {
+            ++index;
+            continue;
+        }
+        size_t start = index;
+        struct lfs_block *block;
+        while (index < blocks && (block = getBlock(entry, index, false)) && !isHole(block)) { ++index; }
+        size_t stop = (index * BLOCK_SIZE < entry->size) ? index * BLOCK_SIZE : entry->size;
+        char line[48];
+        int n = snprintf(line, sizeof(line), "%lu %lu\n", (unsigned long) (start * BLOCK_SIZE), (unsigned long) (stop - start * BLOCK_SIZE));
+        if (size && len + n <= size) { memcpy(value + len, line, n); }
+        len += n;
+    }
+    pthread_rwlock_unlock(&entry->lock);
+    if (size && len > size) { return -ERANGE; }
+    return len;
+}
+
+// an entry unlinked while still open keeps its blocks in memory only
+int writeNode(struct LinkedListNode *current, const char *buf, size_t size, off_t offset) {
+    pthread_rwlock_wrlock(&current->entry->lock);
+    size_t oldSize = current->entry->size;
+    int res = writeBlocks(current->entry, buf, size, offset);
+    if (res == 0) {
+        if (offset + size > oldSize) { current->entry->size = offset + size; }
+        current->entry->modtime = time(NULL);
+        current->entry->data_changed = true;
+        if (!current->entry->unlinked) { res = logBlocks(current->entry, offset, size); }
+    }
+    if (res == 0 && !current->entry->unlinked) { res = logInode(current); }
+    size_t newSize = current->entry->size;
+    pthread_rwlock_unlock(&current->entry->lock);
+    if (newSize != oldSize) { markDirSizes(current->entry->parent); }
+    return res;
+}
+
+// NULL leaves a time as it is; an unlinked entry's times live in memory only
+int setTimes(struct LinkedListNode *current, const time_t *actime, const time_t *modtime) {
+    pthread_rwlock_wrlock(&current->entry->lock);
+    if (actime) { current->entry->actime = *actime; }
+    if (modtime) { current->entry->modtime = *modtime; }
+    int res = (current->entry->unlinked) ? 0 : logInode(current);
+    pthread_rwlock_unlock(&current->entry->lock);
+    return res;
+}
+
+// true when the kernel may keep the file's cached pages
+bool openNode(struct LinkedListNode *current) {
+    pthread_rwlock_wrlock(&current->entry->lock);
+    current->entry->actime = time(NULL);
+    bool keep = !current->entry->data_changed;
+    current->entry->data_changed = false;
+    pthread_rwlock_unlock(&current->entry->lock);
+    __atomic_add_fetch(&current->entry->open_count, 1, __ATOMIC_RELAXED);
+    return keep;
+}
+
+// the last reference to an unlinked entry frees it
+void dropNode(struct LinkedListNode *node, int count) {
+    if (__atomic_sub_fetch(&node->entry->open_count, count, __ATOMIC_ACQ_REL) == 0 && node->entry->unlinked) { freeNode(node); }
+}
+
+// an existing target is replaced as by POSIX rename. A move writes one inode
+// record, a replace puts the target's delete record in front of it. What can
+// fail for lack of memory is done before the target goes. Exclusive
+int moveEntry(struct LinkedListNode *node, struct LinkedListNode *parent, const char *leaf) {
+    if (node == root) { return -EBUSY; }
+    if (parent->entry->isFile) { return -ENOTDIR; }
+    if (loadDirectory(parent) != 0) { return -EIO; }
+    struct LinkedListNode *target = findTokenInCurrent(parent, leaf);
+    if (target == node) { return 0; }
+    if (isBelow(parent, node)) { return -EINVAL; }
+    const char *name = internName(leaf);
+    if (!name) { return -EFAULT; }
+    int res = indexReserve(parent->entry->entries, 1);
+    if (res == 0 && target) {
+        if (!node->entry->isFile && target->entry->isFile) { res = -ENOTDIR; }
+        else if (node->entry->isFile && !target->entry->isFile) { res = -EISDIR; }
+        else if (!target->entry->isFile && loadDirectory(target) != 0) { res = -EIO; }
+        else if (!target->entry->isFile && target->entry->entries->num_entries != 0) { res = -ENOTEMPTY; }
+        if (res == 0) { res = logDelete(target); }
+        if (res == 0) { res = rmThisEntry(target); }
+    }
+    if (res != 0) {
+        releaseName(name);
+        return res;
+    }
+    moveNode(node, parent, name);
+    return logEntry(node);
+}
+
+// resident blocks and holes are copied into memory buffers, cold blocks are
+// handed to FUSE as ranges of the image so they can be spliced without a copy.
+// Compressed cold blocks are copied out of the block cache
+int readNodeBuf(struct lfs_entry *entry, struct fuse_bufvec **bufp, size_t size, off_t offset) {
+    if (!entry->isFile) { return -EISDIR; }
+    pthread_rwlock_rdlock(&entry->lock);
+    size = ((size_t) offset >= entry->size) ? 0 : (size < entry->size - offset) ? size : entry->size - offset;
+    size_t max_bufs = 2 * (size / BLOCK_SIZE + 2);
+    struct fuse_bufvec *vec = calloc(1, sizeof(struct fuse_bufvec) + max_bufs * sizeof(struct fuse_buf));
+    int res = (vec) ? 0 : -EFAULT;
+    struct fuse_buf *last = NULL;
+    size_t done = 0;
+    while (res == 0 && done < size) {
+        size_t pos = offset + done;
+        size_t skip = pos % BLOCK_SIZE;
+        size_t len = (size - done < BLOCK_SIZE - skip) ? size - done : BLOCK_SIZE - skip;
+        struct lfs_block *block = getBlock(entry, pos / BLOCK_SIZE, false);
+        if (block) { block = storedBlock(block); }
+        bool packed = block && !block->data && block->addr && (block->flags & RECORD_COMPRESSED);
+        size_t stored = (block && !block->data && block->addr && !packed) ? coldBytes(block, skip, len) : 0;
+        if (stored && (res = writeBackTo(block->addr + block->len)) != 0) { break; }
+        if (stored) {
+            last = &vec->buf[vec->count++];
+            last->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            last->fd = disk_log.fd;
+            last->pos = coldOffset(block, skip);
+            last->size = stored;
+            last = NULL;
+        }
+        if (stored < len) {
+            if (!last) {
+                last = &vec->buf[vec->count++];
+                last->fd = -1;
+            }
+            char *mem = realloc(last->mem, last->size + len - stored);
+            if (!mem) { 
+                res = -EFAULT;
+                break;
+            }
+            if (block && block->data) {
+                memcpy(mem + last->size, block->data + skip + stored, len - stored);
+                touchBlock(block);
+            } else if (packed) {
+                res = readCached(block, mem + last->size, skip, len);
+            } else { memset(mem + last->size, 0, len - stored); }
+            last->mem = mem;
+            last->size += len - stored;
+        }
+        done += len;
+    }
+    pthread_rwlock_unlock(&entry->lock);
+    if (res == 0) { *bufp = vec; }
+    else if (vec) {
+        size_t i;
+        for (i = 0; i < vec->count; ++i) { free(vec->buf[i].mem); }
+        free(vec);
+    }
+    return res;
+}
+
+// "." and ".." take offsets 1 and 2, a child the offset after its cookie. A
+// cursor asked for its own offset resumes in place, whatever was removed
+// since; any other offset walks the list to the first cookie past it
+int readDir(struct LinkedListNode *dir, struct dir_cursor *cursor, off_t offset, dirent_fn fn, void *ctx) {
+    if (dir->entry->isFile) { return -ENOTDIR; }
+    if (loadDirectory(dir) != 0) { return -EIO; }
+    struct LinkedListNode *parent = (dir->entry->parent) ? dir->entry->parent : dir;
+    if (offset < 1 && fn(ctx, ".", dir, 1)) { return 0; }
+    if (offset < 2 && fn(ctx, "..", parent, 2)) { return 0; }
+    struct LinkedList *list = dir->entry->entries;
+    pthread_rwlock_rdlock(&list->lock);
+    struct LinkedListNode *child = list->head;
+    if (cursor->dir == dir && cursor->offset > 2 && cursor->offset == offset) {
+        child = (cursor->last) ? cursor->last->next : list->head;
+    } else {
+        while (child != NULL && (off_t) child->cookie + 2 <= offset) { child = child->next; }
+    }
+    while (child != NULL && !fn(ctx, child->name, child, child->cookie + 2)) {
+        cursor->last = child;
+        cursor->offset = child->cookie + 2;
+        child = child->next;
+    }
+    pthread_rwlock_unlock(&list->lock);
+    return 0;
+}
+
+// an open directory holds a reference, so a cursor never outlives its list
+int openDir(struct LinkedListNode *dir, struct fuse_file_info *fi) {
+    if (dir->entry->isFile) { return -ENOTDIR; }
+    struct dir_cursor *cursor = calloc(1, sizeof(struct dir_cursor));
+    if (!cursor) { return -EFAULT; }
+    __atomic_add_fetch(&dir->entry->open_count, 1, __ATOMIC_RELAXED);
+    cursor->dir = dir;
+    struct LinkedList *list = dir->entry->entries;
+    pthread_rwlock_wrlock(&list->lock);
+    cursor->next = list->cursors;
+    if (cursor->next) { cursor->next->prev = cursor; }
+    list->cursors = cursor;
+    pthread_rwlock_unlock(&list->lock);
+    fi->fh = (uint64_t) cursor;
+    return 0;
+}
+
+void releaseDir(struct fuse_file_info *fi) {
+    struct dir_cursor *cursor = (struct dir_cursor *) fi->fh;
+    struct LinkedList *list = cursor->dir->entry->entries;
+    pthread_rwlock_wrlock(&list->lock);
+    if (cursor->prev) { cursor->prev->next = cursor->next; }
+    else { list->cursors = cursor->next; }
+    if (cursor->next) { cursor->next->prev = cursor->prev; }
+    pthread_rwlock_unlock(&list->lock);
+    dropNode(cursor->dir, 1);
+    free(cursor);
+}
+
+// the type and inode number go with every name, so the kernel can answer
+// d_type without a getattr
+void direntStat(struct LinkedListNode *node, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = ((u_int64_t) node->entry->generation << 32) | (u_int32_t) node->entry->id;
+    st->st_mode = (node->entry->isFile) ? S_IFREG : S_IFDIR;
+}
+
+// struct methods
+int lfs_getattr(const char *path, struct stat *stbuf) {
+    pthread_rwlock_rdlock(&tree_lock);
+    struct LinkedListNode *current = findEntry(path);
+    if (current) { statNode(current, stbuf); }
+    pthread_rwlock_unlock(&tree_lock);
+    return (current) ? 0 : -ENOENT;
+}
+
+int lfs_opendir(const char *path, struct fuse_file_info *fi) {
+    pthread_rwlock_rdlock(&tree_lock);
+    struct LinkedListNode *current = findEntry(path);
+    int res = (current) ? openDir(current, fi) : -ENOENT;
+    pthread_rwlock_unlock(&tree_lock);
+    return res;
+}
+
+struct filler_ctx {
+    void *buf;
+    fuse_fill_dir_t filler;
+};
+
+int fillDirent(void *ctx, const char *name, struct LinkedListNode *node, off_t next) {
+    struct filler_ctx *fill = ctx;
+    struct stat st;
+    direntStat(node, &st);
+    return fill->filler(fill->buf, name, &st, next);
+}
+
+// passing offsets puts libfuse in the mode where it asks for one reply's
+// worth at a time instead of buffering the whole directory
+int lfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    struct filler_ctx fill = { buf, filler };
+    pthread_rwlock_rdlock(&tree_lock);
+    struct LinkedListNode *current = findEntry(path);
+    int res = (current) ? readDir(current, (struct dir_cursor *) fi->fh, offset, fillDirent, &fill) : -ENOENT;
+    pthread_rwlock_unlock(&tree_lock);
+    return res;
+}
+
+int lfs_releasedir(const char *path, struct fuse_file_info *fi) {
+    pthread_rwlock_rdlock(&tree_lock);
+    releaseDir(fi);
+    pthread_rwlock_unlock(&tree_lock);
+    return 0;
 }
 
 int lfs_mkdir(const char *path, mode_t mode) {
-    int res = makeEntry(path, false);
-    if (res != 0) { return res; }
-    return saveTree(root);
+    pthread_rwlock_rdlock(&tree_lock);
+    int res = makeEntry(path, false, -1);
+    if (res == 0) { res = logEntry(findEntry(path)); }
+    pthread_rwlock_unlock(&tree_lock);
+    if (res == 0) { res = commitOp(); }
+    return res;
 }
 
 int lfs_rmdir(const char *path) {
-    int res = rmThisEntry(findEntry(path));    
-    if (res != 0) { return res; }
-    return saveTree(root);
+    pthread_rwlock_wrlock(&tree_lock);
+    struct LinkedListNode *current = findEntry(path);
+    int res = (current) ? removeDir(current) : -ENOENT;
+    pthread_rwlock_unlock(&tree_lock);
+    if (res == 0) { res = commitOp(); }
+    return res;
 }
 
 int lfs_mknod(const char *path, mode_t mode, dev_t device) { 
-    int res = makeEntry(path, true);
-    if (res != 0) { return res; }
-    return saveTree(root);
+    pthread_rwlock_rdlock(&tree_lock);
+    int res = makeEntry(path, true, -1);
+    if (res == 0) { res = logEntry(findEntry(path)); }
+    pthread_rwlock_unlock(&tree_lock);
+    if (res == 0) { res = commitOp(); }
+    return res;
 }
 
 int lfs_unlink(const char *path) {
-    int res = rmThisEntry(findEntry(path));    
-    if (res != 0) { return res; }
-    return saveTree(root);
+    pthread_rwlock_wrlock(&tree_lock);
+    struct LinkedListNode *current = findEntry(path);
+    int res = (current) ? removeFile(current) : -ENOENT;
+    pthread_rwlock_unlock(&tree_lock);
+    if (res == 0) { res = commitOp(); }
+    return res;
 }
 
 int lfs_truncate(const char *path, off_t offset) {
+    pthread_rwlock_rdlock(&tree_lock);
     struct LinkedListNode *current = findEntry(path);
-    if (current == NULL) { return -ENOENT; }
-    if (!current->entry->isFile) { return -EISDIR; }
-    size_t oldSize = current->entry->size;
-    if (current->entry->contents == NULL) {
-        current->entry->contents = calloc(offset, sizeof(char));
-        if (!current->entry->contents) { return -EFAULT; }
-    } else if (oldSize < offset) {
-        char *newContent = calloc(offset, sizeof(char));
-        if (!newContent) { return -EFAULT; }
-        strncpy(newContent, current->entry->contents, oldSize);
-        free(current->entry->contents);
-        current->entry->contents = newContent;
-    } else { current->entry->contents[offset] = '\0'; }
-    current->entry->size = offset;
-    updateDirSizesToRoot(current->entry->parent, offset - oldSize);
-    return saveTree(root);
+    int res = (current) ? truncateNode(current, offset) : -ENOENT;
+    pthread_rwlock_unlock(&tree_lock);
+    if (res == 0) { res = commitOp(); }
+    return res;
+}
+
+int lfs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    pthread_rwlock_rdlock(&tree_lock);
+    int res = fallocateNode((struct LinkedListNode*) fi->fh, mode, offset, length);
+    pthread_rwlock_unlock(&tree_lock);
+    if (res == 0) { res = commitOp(); }
+    return res;
 }
 
 int lfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    struct LinkedListNode *current = (struct LinkedListNode*) fi->fh;
-    size_t oldSize = current->entry->size;
-    char* tmp = malloc(size+3);
-    if (tmp == NULL) { return -EFAULT; }
-    strncpy(tmp, buf, size);
-    tmp[size] = '\0';
-    free(current->entry->contents);
-    current->entry->contents = tmp;
-    current->entry->size = size;
-    current->entry->modtime = time(NULL);
-    updateDirSizesToRoot(current->entry->parent, -(oldSize - size));
-    int res = saveTree(root);
-    return (res == 0) ? size : res;
+    if (size == 0) { return 0; }
+    pthread_rwlock_rdlock(&tree_lock);
+    int res = writeNode((struct LinkedListNode*) fi->fh, buf, size, offset);
+    pthread_rwlock_unlock(&tree_lock);
+    if (res == 0) { res = commitOp(); }
+    return (res == 0) ? (int) size : res;
 }
 
 int lfs_rename(const char *from, const char *to) {
-    struct LinkedListNode *new_node = findEntry(to);
-    if (new_node) { return -EEXIST; } 
-    struct LinkedListNode *old_node = findEntry(from);
-    if (!old_node) { return -ENOENT; } 
-    int res = makeEntry(to, old_node->entry->isFile);
-    if (res) { return res; }
-    new_node = findEntry(to);
-    new_node->entry->id = old_node->entry->id;
-    new_node->entry->size = old_node->entry->size;
-    new_node->entry->actime = old_node->entry->actime;
-    new_node->entry->modtime = old_node->entry->modtime;
-    updateDirSizesToRoot(new_node->entry->parent, new_node->entry->size); 
-    if (!old_node->entry->isFile) {
-        struct LinkedList *tmp = new_node->entry->entries;
-        new_node->entry->entries = old_node->entry->entries;
-        old_node->entry->entries = tmp;
-        updateChildrenToParent(new_node);
-        lfs_rmdir(from);
-    } else {
-        char *tmp = new_node->entry->contents;
-        new_node->entry->contents = old_node->entry->contents;
-        old_node->entry->contents = tmp;
-        lfs_unlink(from);
-    } 
-    return 0;
+    const char *leaf = strrchr(to, '/');
+    if (!leaf || leaf[1] == '\0') { return -EINVAL; }
+    size_t len = (leaf == to) ? 1 : (size_t) (leaf - to);
+    char *parent_path = malloc(len + 1);
+    if (!parent_path) { return -EFAULT; }
+    memcpy(parent_path, to, len);
+    parent_path[len] = '\0';
+    ++leaf;
+
+    pthread_rwlock_wrlock(&tree_lock);
+    struct LinkedListNode *node = findEntry(from);
+    struct LinkedListNode *parent = findEntry(parent_path);
+    free(parent_path);
+    int res = (node && parent) ? moveEntry(node, parent, leaf) : -ENOENT;
+    if (res == 0) {
+        dcacheInvalidateTree(from);
+        dcacheInvalidateTree(to);
+    }
+    pthread_rwlock_unlock(&tree_lock);
+    if (res == 0) { res = commitOp(); }
+    return res;
 }
 
+
 //Permission
 int lfs_open(const char *path, struct fuse_file_info *fi ) {
-    struct LinkedListNode *foundFile;
-    if (!(foundFile = findEntry(path))) { return -ENOENT; }
-    foundFile->entry->actime = time(NULL);
+    pthread_rwlock_rdlock(&tree_lock);
+    struct LinkedListNode *foundFile = findEntry(path);
+    if (foundFile) { fi->keep_cache = openNode(foundFile); }
     fi->fh = (uint64_t) foundFile;
-    return 0;
+    pthread_rwlock_unlock(&tree_lock);
+    return (foundFile) ? 0 : -ENOENT;
 }
 
 int lfs_read(const char* path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
     struct LinkedListNode *file = (struct LinkedListNode*) fi->fh;
-    if (!file->entry->isFile) { return -EISDIR; }
-    if (file->entry->contents == NULL || file->entry->size == 0) { return 0; }
-    size_t len = (file->entry->size < size) ? file->entry->size : size;
-    strncpy(buf, file->entry->contents, len);
+    pthread_rwlock_rdlock(&tree_lock);
+    if (!file->entry->isFile) { 
+        pthread_rwlock_unlock(&tree_lock);
+        return -EISDIR; 
+    }
+    pthread_rwlock_rdlock(&file->entry->lock);
+    int res = readBlocks(file->entry, buf, size, offset);
+    pthread_rwlock_unlock(&file->entry->lock);
+    pthread_rwlock_unlock(&tree_lock);
+    return res;
+}
+
+int lfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    pthread_rwlock_rdlock(&tree_lock);
+    int res = readNodeBuf(((struct LinkedListNode*) fi->fh)->entry, bufp, size, offset);
+    pthread_rwlock_unlock(&tree_lock);
+    return res;
+}
+
+int lfs_release(const char *path, struct fuse_file_info *fi) {
+    struct LinkedListNode *node = (struct LinkedListNode*) fi->fh;
+    if (!node) { return 0; }
+    pthread_rwlock_rdlock(&tree_lock);
+    dropNode(node, 1);
+    pthread_rwlock_unlock(&tree_lock);
+    return 0;
+}
+
+int formatStats(char *buf, size_t size) {
+    pthread_mutex_lock(&names.lock);
+    size_t interned = names.count;
+    pthread_mutex_unlock(&names.lock);
+    pthread_mutex_lock(&inodes.lock);
+    size_t live = inodes.live;
+    size_t inode_bytes = inodes.allocated * sizeof(struct inode_chunk);
+    pthread_mutex_unlock(&inodes.lock);
+    int len = snprintf(buf, size,
+        "dcache_size %lu\n"
+        "dcache_hits %lu\n"
+        "dcache_negative_hits %lu\n"
+        "dcache_misses %lu\n"
+        "dcache_invalidations %lu\n"
+        "names_interned %lu\n"
+        "inodes_live %lu\n"
+        "inodes_bytes %lu\n",
+        (unsigned long) dcache.size, (unsigned long) dcache.hits, (unsigned long) dcache.negative_hits,
+        (unsigned long) dcache.misses, (unsigned long) dcache.invalidations, (unsigned long) interned,
+        (unsigned long) live, (unsigned long) inode_bytes);
+    int class;
+    for (class = 0; class < NUM_SLABS && len >= 0 && (size_t) len < size; ++class) {
+        struct lfs_slab *slab = &slabs[class];
+        pthread_mutex_lock(&slab->lock);
+        int res = snprintf(buf + len, size - len, "slab_%s_objects %lu\nslab_%s_bytes %lu\n",
+            slab->name, (unsigned long) slab->objects, slab->name, (unsigned long) (slab->num_pages * SLAB_PAGE_SIZE));
+        pthread_mutex_unlock(&slab->lock);
+        len = (res < 0) ? res : len + res;
+    }
+    pthread_mutex_lock(&log_lock);
+    unsigned long blocks = shared.count, references = shared.references, hits = shared.hits;
+    unsigned long stored = shared.stored_bytes, referenced = shared.referenced_bytes;
+    struct compress_stats packed = compression;
+    unsigned long evictions = memory.evictions;
+    pthread_mutex_unlock(&log_lock);
+    pthread_mutex_lock(&cache.lock);
+    unsigned long cached = cache.used, cache_hits = cache.hits, cache_misses = cache.misses;
+    pthread_mutex_unlock(&cache.lock);
+    if (len >= 0 && (size_t) len < size) {
+        int res = snprintf(buf + len, size - len,
+            "dedup_blocks %lu\n"
+            "dedup_references %lu\n"
+            "dedup_hits %lu\n"
+            "dedup_stored_bytes %lu\n"
+            "dedup_referenced_bytes %lu\n"
+            "dedup_ratio %.2f\n",
+            blocks, references, hits, stored, referenced, (stored) ? (double) referenced / stored : 1.0);
+        len = (res < 0) ? res : len + res;
+    }
+    if (len >= 0 && (size_t) len < size) {
+        int res = snprintf(buf + len, size - len,
+            "compress_blocks %lu\n"
+            "compress_uncompressed_blocks %lu\n"
+            "compress_raw_bytes %lu\n"
+            "compress_stored_bytes %lu\n"
+            "compress_ratio %.2f\n"
+            "compress_opted_out_files %lu\n"
+            "cache_resident_blocks %lu\n"
+            "cache_hits %lu\n"
+            "cache_misses %lu\n",
+            (unsigned long) packed.compressed, (unsigned long) packed.uncompressed, (unsigned long) packed.raw_bytes,
+            (unsigned long) packed.stored_bytes, (packed.stored_bytes) ? (double) packed.raw_bytes / packed.stored_bytes : 1.0,
+            (unsigned long) packed.opted_out, cached, cache_hits, cache_misses);
+        len = (res < 0) ? res : len + res;
+    }
+    if (len >= 0 && (size_t) len < size) {
+        int res = snprintf(buf + len, size - len,
+            "memory_budget_bytes %lu\n"
+            "memory_resident_bytes %lu\n"
+            "memory_evictions %lu\n"
+            "memory_faults %lu\n",
+            (unsigned long) (memoryBudget() * BLOCK_SIZE),
+            (unsigned long) (__atomic_load_n(&memory.resident, __ATOMIC_RELAXED) * BLOCK_SIZE),
+            evictions, (unsigned long) __atomic_load_n(&memory.faults, __ATOMIC_RELAXED));
+        len = (res < 0) ? res : len + res;
+    }
+    return len;
+}
+
+// size 0 asks for the length only
+int readStats(char *value, size_t size) {
+    char stats[4096];
+    int len = formatStats(stats, sizeof(stats));
+    if (len < 0) { return -EIO; }
+    if ((size_t) len >= sizeof(stats)) { len = sizeof(stats) - 1; }
+    if (size == 0) { return len; }
+    if ((size_t) len > size) { return -ERANGE; }
+    memcpy(value, stats, len);
     return len;
 }
 
-int lfs_release(const char *path, struct fuse_file_info *fi) { return 0; }
+int lfs_getxattr(const char *path, const char *name, char *value, size_t size) {
+    pthread_rwlock_rdlock(&tree_lock);
+    struct LinkedListNode *current = findEntry(path);
+    int res = (current) ? -ENODATA : -ENOENT;
+    if (current && strcmp(name, EXTENTS_XATTR) == 0) { res = readExtents(current->entry, value, size); }
+    pthread_rwlock_unlock(&tree_lock);
+    if (current == root && strcmp(name, STATS_XATTR) == 0) { res = readStats(value, size); }
+    return res;
+}
+
+// close only hurries the flusher along, fsync waits for the commit
+int lfs_flush(const char *path, struct fuse_file_info *fi) {
+    if (flusher.running) { pthread_cond_signal(&flusher.wake); }
+    return 0;
+}
+
+int lfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) { return flushLog(); }
 
 int lfs_utime(const char *path, struct utimbuf *times) {
+    pthread_rwlock_rdlock(&tree_lock);
     struct LinkedListNode *current = findEntry(path);
-    current->entry->actime = times->actime;
-    current->entry->modtime = times->modtime;
-    return saveTree(root);
+    int res = (current) ? setTimes(current, &times->actime, &times->modtime) : -ENOENT;
+    pthread_rwlock_unlock(&tree_lock);
+    if (res == 0) { res = commitOp(); }
+    return res;
+}
+
+// writes come in as large as the channel allows (max_write is already capped
+// to its buffer) instead of a page at a time, and cold blocks that read_buf
+// hands out as ranges of the image are spliced to the kernel. Splicing
+// writes in would not save a copy, since data is gathered into blocks anyway
+void *lfs_init(struct fuse_conn_info *conn) {
+    conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    startFlusher();
+    startCleaner();
+    return NULL;
+}
+
+void lfs_destroy(void *private_data) { 
+    stopCleaner(); 
+    stopFlusher();
 }
 
 int init() {
-    root = malloc(sizeof(struct LinkedListNode));
-    if (!root) { return -EFAULT; }
-    root->entry = malloc(sizeof(struct lfs_entry));
-    if (!root->entry) { 
-        free(root);
-        return -EFAULT; 
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&log_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    initChecksum();
+    if (!(root = allocNode("/", false, generateId()))) { return -EFAULT; }
+    int res = initDcache(config.dcache_size);
+    if (res == 0) { res = initCache(config.cache_blocks); }
+    if (res == 0) { res = mountLog(); }
+    if (res == 0) { res = loadFreeIds(); }
+    if (res == 0) { res = indexShared(); }
+    if (res != 0) {
+        unmountLog();
+        freeDcache();
+        freeCache();
+        freeTree();
     }
-    strcpy(root->entry->name, "/");
-    root->entry->parent = NULL;
-    root->entry->size = 0;
-    root->entry->isFile = false;
-    root->entry->actime = time(NULL);
-    root->entry->modtime = time(NULL);
-    root->entry->id = generateId();
-    root->entry->entries = malloc(sizeof(struct LinkedList));
-    if (!root->entry->entries) { 
-        free(root->entry);
-        free(root);
-        return -EFAULT; 
+    return res;
+}
+
+#ifdef LFS_LOWLEVEL
+// low-level methods. The kernel walks paths in its own dentry cache and names
+// an inode by its node's address, so every request finds its node without a
+// lookup. Each entry reply takes a reference that forget gives back, which
+// keeps an unlinked node around for as long as the kernel knows it
+struct LinkedListNode *llNode(fuse_ino_t ino) {
+    return (ino == FUSE_ROOT_ID) ? root : (struct LinkedListNode *) (uintptr_t) ino;
+}
+
+void entryParam(struct LinkedListNode *node, struct fuse_entry_param *e) {
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    e->ino = (uintptr_t) node;
+    e->generation = node->entry->generation;
+    e->attr_timeout = config.cache_timeout;
+    e->entry_timeout = config.cache_timeout;
+    statNode(node, &e->attr);
+    __atomic_add_fetch(&node->entry->open_count, 1, __ATOMIC_RELAXED);
+}
+
+void lfs_ll_init(void *userdata, struct fuse_conn_info *conn) { lfs_init(conn); }
+
+void lfs_ll_destroy(void *userdata) { lfs_destroy(userdata); }
+
+void lfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param e;
+    pthread_rwlock_rdlock(&tree_lock);
+    struct LinkedListNode *node = findTokenInCurrent(llNode(parent), name);
+    if (node) { entryParam(node, &e); }
+    pthread_rwlock_unlock(&tree_lock);
+    if (!node) {
+        // a zero inode caches the miss for as long as an entry
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = config.cache_timeout;
     }
-    root->entry->entries->head = NULL;
-    root->entry->entries->tail = NULL;
-    root->entry->entries->num_entries = 0;
+    fuse_reply_entry(req, &e);
+}
 
-    int res = loadFromDisk();
-    if (res == -1) {
-        printf("Disk.img file does not exists - creating empty one\n");
-        res = 0;
-    } else if (res != 0) {
-        free(root->entry->entries);
-        free(root->entry);
-        free(root);
+void lfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    pthread_rwlock_rdlock(&tree_lock);
+    if (ino != FUSE_ROOT_ID) { dropNode(llNode(ino), nlookup); }
+    pthread_rwlock_unlock(&tree_lock);
+    fuse_reply_none(req);
+}
+
+void lfs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    size_t i;
+    pthread_rwlock_rdlock(&tree_lock);
+    for (i = 0; i < count; ++i) {
+        if (forgets[i].ino != FUSE_ROOT_ID) { dropNode(llNode(forgets[i].ino), forgets[i].nlookup); }
+    }
+    pthread_rwlock_unlock(&tree_lock);
+    fuse_reply_none(req);
+}
+
+void lfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct stat st;
+    pthread_rwlock_rdlock(&tree_lock);
+    statNode(llNode(ino), &st);
+    pthread_rwlock_unlock(&tree_lock);
+    fuse_reply_attr(req, &st, config.cache_timeout);
+}
+
+void lfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    struct LinkedListNode *node = llNode(ino);
+    time_t now = time(NULL);
+    struct stat st;
+    int res = (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) ? -ENOSYS : 0;
+    pthread_rwlock_rdlock(&tree_lock);
+    if (res == 0 && (to_set & FUSE_SET_ATTR_SIZE)) { res = truncateNode(node, attr->st_size); }
+    if (res == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+        const time_t *actime = (to_set & FUSE_SET_ATTR_ATIME_NOW) ? &now : (to_set & FUSE_SET_ATTR_ATIME) ? &attr->st_atime : NULL;
+        const time_t *modtime = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? &now : (to_set & FUSE_SET_ATTR_MTIME) ? &attr->st_mtime : NULL;
+        res = setTimes(node, actime, modtime);
+    }
+    if (res == 0) { statNode(node, &st); }
+    pthread_rwlock_unlock(&tree_lock);
+    if (res == 0) { res = commitOp(); }
+    if (res == 0) { fuse_reply_attr(req, &st, config.cache_timeout); }
+    else { fuse_reply_err(req, -res); }
+}
+
+void makeNode(fuse_req_t req, fuse_ino_t parent, const char *name, bool isFile) {
+    struct fuse_entry_param e;
+    struct LinkedListNode *node = NULL;
+    pthread_rwlock_rdlock(&tree_lock);
+    int res = addChild(llNode(parent), name, isFile, -1, &node);
+    if (res == 0) { res = logEntry(node); }
+    if (res == 0) { entryParam(node, &e); }
+    pthread_rwlock_unlock(&tree_lock);
+    if (res == 0 && (res = commitOp()) != 0) {
+        pthread_rwlock_rdlock(&tree_lock);
+        dropNode(node, 1);
+        pthread_rwlock_unlock(&tree_lock);
+    }
+    if (res == 0) { fuse_reply_entry(req, &e); }
+    else { fuse_reply_err(req, -res); }
+}
+
+void lfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+    makeNode(req, parent, name, true);
+}
+
+void lfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    makeNode(req, parent, name, false);
+}
+
+void removeNode(fuse_req_t req, fuse_ino_t parent, const char *name, bool dir) {
+    pthread_rwlock_wrlock(&tree_lock);
+    struct LinkedListNode *node = findTokenInCurrent(llNode(parent), name);
+    int res = (!node) ? -ENOENT : (dir) ? removeDir(node) : removeFile(node);
+    pthread_rwlock_unlock(&tree_lock);
+    if (res == 0) { res = commitOp(); }
+    fuse_reply_err(req, -res);
+}
+
+void lfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) { removeNode(req, parent, name, false); }
+
+void lfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) { removeNode(req, parent, name, true); }
+
+void lfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+    pthread_rwlock_wrlock(&tree_lock);
+    struct LinkedListNode *node = findTokenInCurrent(llNode(parent), name);
+    int res = (node) ? moveEntry(node, llNode(newparent), newname) : -ENOENT;
+    pthread_rwlock_unlock(&tree_lock);
+    if (res == 0) { res = commitOp(); }
+    fuse_reply_err(req, -res);
+}
+
+// an interrupted open is never released
+void lfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct LinkedListNode *node = llNode(ino);
+    pthread_rwlock_rdlock(&tree_lock);
+    fi->keep_cache = openNode(node);
+    pthread_rwlock_unlock(&tree_lock);
+    fi->fh = (uint64_t) node;
+    if (fuse_reply_open(req, fi) == -ENOENT) {
+        pthread_rwlock_rdlock(&tree_lock);
+        dropNode(node, 1);
+        pthread_rwlock_unlock(&tree_lock);
+    }
+}
+
+void lfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct fuse_bufvec *vec = NULL;
+    pthread_rwlock_rdlock(&tree_lock);
+    int res = readNodeBuf(llNode(ino)->entry, &vec, size, off);
+    pthread_rwlock_unlock(&tree_lock);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_data(req, vec, FUSE_BUF_SPLICE_MOVE);
+    size_t i;
+    for (i = 0; i < vec->count; ++i) { free(vec->buf[i].mem); }
+    free(vec);
+}
+
+// a single memory buffer is written from where it lies, anything else is
+// gathered into one first
+void lfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
+    size_t size = fuse_buf_size(bufv);
+    char *data = NULL;
+    const char *src = bufv->buf[0].mem;
+    int res = 0;
+    if (bufv->count != 1 || (bufv->buf[0].flags & FUSE_BUF_IS_FD)) {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        src = dst.buf[0].mem = data = malloc(size);
+        ssize_t copied = (data) ? fuse_buf_copy(&dst, bufv, 0) : -EFAULT;
+        if (copied < 0) { res = copied; }
+        else { size = copied; }
     }
+    pthread_rwlock_rdlock(&tree_lock);
+    if (res == 0 && size != 0) { res = writeNode(llNode(ino), src, size, off); }
+    pthread_rwlock_unlock(&tree_lock);
+    free(data);
+    if (res == 0) { res = commitOp(); }
+    if (res == 0) { fuse_reply_write(req, size); }
+    else { fuse_reply_err(req, -res); }
+}
+
+void lfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -lfs_fallocate(NULL, mode, offset, length, fi));
+}
+
+void lfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -lfs_flush(NULL, fi));
+}
+
+void lfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -lfs_release(NULL, fi));
+}
+
+void lfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -flushLog());
+}
+
+struct reply_buf {
+    fuse_req_t req;
+    char *buf;
+    size_t size;
+    size_t used;
+};
+
+int addDirent(void *ctx, const char *name, struct LinkedListNode *node, off_t next) {
+    struct reply_buf *reply = ctx;
+    struct stat st;
+    direntStat(node, &st);
+    size_t len = fuse_add_direntry(reply->req, reply->buf + reply->used, reply->size - reply->used, name, &st, next);
+    if (len > reply->size - reply->used) { return 1; }
+    reply->used += len;
+    return 0;
+}
+
+void lfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    pthread_rwlock_rdlock(&tree_lock);
+    int res = openDir(llNode(ino), fi);
+    pthread_rwlock_unlock(&tree_lock);
+    if (res != 0) { fuse_reply_err(req, -res); }
+    else if (fuse_reply_open(req, fi) == -ENOENT) {
+        pthread_rwlock_rdlock(&tree_lock);
+        releaseDir(fi);
+        pthread_rwlock_unlock(&tree_lock);
+    }
+}
+
+void lfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct reply_buf reply = { req, malloc(size), size, 0 };
+    int res = (reply.buf) ? 0 : -EFAULT;
+    pthread_rwlock_rdlock(&tree_lock);
+    if (res == 0) { res = readDir(llNode(ino), (struct dir_cursor *) fi->fh, off, addDirent, &reply); }
+    pthread_rwlock_unlock(&tree_lock);
+    if (res == 0) { fuse_reply_buf(req, reply.buf, reply.used); }
+    else { fuse_reply_err(req, -res); }
+    free(reply.buf);
+}
+
+void lfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    pthread_rwlock_rdlock(&tree_lock);
+    releaseDir(fi);
+    pthread_rwlock_unlock(&tree_lock);
+    fuse_reply_err(req, 0);
+}
+
+void lfs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+    bool stats = ino == FUSE_ROOT_ID && strcmp(name, STATS_XATTR) == 0;
+    if (!stats && strcmp(name, EXTENTS_XATTR) != 0) {
+        fuse_reply_err(req, ENODATA);
+        return;
+    }
+    char *value = (size) ? malloc(size) : NULL;
+    int len = (size && !value) ? -EFAULT : 0;
+    if (len == 0 && stats) { len = readStats(value, size); }
+    else if (len == 0) {
+        pthread_rwlock_rdlock(&tree_lock);
+        len = readExtents(llNode(ino)->entry, value, size);
+        pthread_rwlock_unlock(&tree_lock);
+    }
+    if (len < 0) { fuse_reply_err(req, -len); }
+    else if (size == 0) { fuse_reply_xattr(req, len); }
+    else { fuse_reply_buf(req, value, len); }
+    free(value);
+}
+
+static struct fuse_lowlevel_ops lfs_ll_oper = {
+    .init         = lfs_ll_init,
+    .destroy      = lfs_ll_destroy,
+    .lookup       = lfs_ll_lookup,
+    .forget       = lfs_ll_forget,
+    .forget_multi = lfs_ll_forget_multi,
+    .getattr      = lfs_ll_getattr,
+    .setattr      = lfs_ll_setattr,
+    .mknod        = lfs_ll_mknod,
+    .mkdir        = lfs_ll_mkdir,
+    .unlink       = lfs_ll_unlink,
+    .rmdir        = lfs_ll_rmdir,
+    .rename       = lfs_ll_rename,
+    .open         = lfs_ll_open,
+    .read         = lfs_ll_read,
+    .write_buf    = lfs_ll_write_buf,
+    .fallocate    = lfs_ll_fallocate,
+    .flush        = lfs_ll_flush,
+    .release      = lfs_ll_release,
+    .fsync        = lfs_ll_fsync,
+    .opendir      = lfs_ll_opendir,
+    .readdir      = lfs_ll_readdir,
+    .releasedir   = lfs_ll_releasedir,
+    .fsyncdir     = lfs_ll_fsync,
+    .getxattr     = lfs_ll_getxattr
+};
+
+// the session loop fuse_main runs for the path callbacks
+int runLowLevel(struct fuse_args *args) {
+    char *mountpoint = NULL;
+    int multithreaded, foreground;
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) { return 1; }
+    struct fuse_chan *ch = fuse_mount(mountpoint, args);
+    struct fuse_session *se = (ch) ? fuse_lowlevel_new(args, &lfs_ll_oper, sizeof(lfs_ll_oper), NULL) : NULL;
+    int res = (se && fuse_set_signal_handlers(se) != -1) ? 0 : 1;
+    if (res == 0) {
+        fuse_session_add_chan(se, ch);
+        notify_chan = ch;
+        fuse_daemonize(foreground);
+        res = (multithreaded) ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+        notify_chan = NULL;
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+    }
+    if (se) { fuse_session_destroy(se); }
+    if (ch) { fuse_unmount(mountpoint, ch); }
+    free(mountpoint);
     return res;
 }
+#endif
 
 int main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &config, lfs_opts, NULL) == -1) { return 1; }
+    if (config.clean_high < config.clean_low) { config.clean_high = config.clean_low; }
+    if (config.commit_bytes > SEGMENT_SIZE) { config.commit_bytes = SEGMENT_SIZE; }
     int res = init();
-    if (res != 0) { return res; }
-    fuse_main(argc, argv, &lfs_oper);
-    res = saveTree(root);
-    dfsDelete(root);
+    if (res != 0) { 
+        printf("Failed to mount disk.img: %s\n", strerror(-res));
+        fuse_opt_free_args(&args);
+        return res; 
+    }
+#ifdef LFS_LOWLEVEL
+    runLowLevel(&args);
+#else
+    // in front of the user's arguments, so libfuse's own options still win
+    char timeouts[128];
+    snprintf(timeouts, sizeof(timeouts), "-oentry_timeout=%u,negative_timeout=%u,attr_timeout=%u",
+        config.cache_timeout, config.cache_timeout, config.cache_timeout);
+    fuse_opt_insert_arg(&args, 1, timeouts);
+    fuse_main(args.argc, args.argv, &lfs_oper, NULL);
+#endif
+    stopCleaner();
+    stopFlusher();
+    writeCheckpoint(-1);
+    unmountLog();
+    freeDcache();
+    freeCache();
+    freeTree();
+    fuse_opt_free_args(&args);
     return res;
 }
@@ -0,0 +1,842 @@
+// regression tests for lfs. Given the lfs binary, each test mounts a fresh
+// image on a temporary directory, works through the mount point, remounts to
+// check what the image kept and prints one line per test. make check builds
+// both backends and runs it on each; by hand:
+//   ./lfs_check ./lfs_ll [lfs options]
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PATH_LEN 4096
+#define MOUNT_TIMEOUT 60
+#define DIR_ENTRIES 5000
+#define CODEC_BLOCK 4096
+#define CODEC_FUZZ 20000
+#define BLOCK 4096
+#define CHURN_ROUNDS 40
+#define STRESS_WORKERS 8
+#define STRESS_ROUNDS 200
+#define STRESS_NAMES 16
+#define SPARSE_BLOCKS 101
+
+char tmpdir[PATH_LEN];
+char mnt[PATH_LEN + 8];
+char *binary;
+const char *options;
+pid_t server = -1;
+int failures = 0;
+
+// lfs_check links lfs.c in with its main renamed, for the block codec
+size_t compressBlock(const char *src, size_t len, char *dst, size_t capacity);
+int decompressBlock(const char *src, size_t len, char *dst, size_t capacity);
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// unmounts through fusermount and waits for the server to write its
+// checkpoint and exit
+void unmountLfs() {
+    if (server < 0) { return; }
+    pid_t pid = fork();
+    if (pid == 0) {
+        execlp("fusermount", "fusermount", "-u", mnt, (char *) NULL);
+        _exit(127);
+    }
+    if (pid > 0) { waitpid(pid, NULL, 0); }
+    waitpid(server, NULL, 0);
+    server = -1;
+}
+
+// kills the server as a crash would, so that nothing past what it has
+// written reaches the image, and detaches the mount
+void crashLfs() {
+    if (server < 0) { return; }
+    kill(server, SIGKILL);
+    unmountLfs();
+}
+
+void fail(const char *what, const char *path) {
+    fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+    unmountLfs();
+    exit(1);
+}
+
+// starts lfs in the foreground inside the temporary directory, so it opens
+// the image there, and returns once the mount point has changed device. extra
+// options go after the ones lfs_check was given
+void mountLfs(const char *extra) {
+    char all[PATH_LEN];
+    snprintf(all, sizeof(all), "%s%s%s", (options) ? options : "", (options && extra) ? "," : "", (extra) ? extra : "");
+    struct stat parent, st;
+    if (stat(tmpdir, &parent) != 0) { fail("stat", tmpdir); }
+    double start = now();
+    server = fork();
+    if (server < 0) { fail("fork", binary); }
+    if (server == 0) {
+        char log[PATH_LEN + 16];
+        snprintf(log, sizeof(log), "%s/lfs.log", tmpdir);
+        int fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd >= 0) { dup2(fd, 1); dup2(fd, 2); }
+        if (chdir(tmpdir) != 0) { _exit(127); }
+        if (all[0]) { execl(binary, binary, "-f", "-o", all, mnt, (char *) NULL); }
+        else { execl(binary, binary, "-f", mnt, (char *) NULL); }
+        _exit(127);
+    }
+    while (now() - start < MOUNT_TIMEOUT) {
+        if (stat(mnt, &st) == 0 && st.st_dev != parent.st_dev) { return; }
+        if (waitpid(server, NULL, WNOHANG) == server) {
+            server = -1;
+            fprintf(stderr, "%s exited before mounting, see %s/lfs.log\n", binary, tmpdir);
+            exit(1);
+        }
+        usleep(1000);
+    }
+    fprintf(stderr, "%s did not mount within %d s\n", binary, MOUNT_TIMEOUT);
+    kill(server, SIGTERM);
+    unmountLfs();
+    exit(1);
+}
+
+// every test starts on an empty image
+void freshImage() {
+    char path[PATH_LEN + 16];
+    snprintf(path, sizeof(path), "%s/disk.img", tmpdir);
+    if (unlink(path) != 0 && errno != ENOENT) { fail("unlink", path); }
+}
+
+bool check(bool ok, const char *test, const char *what) {
+    if (!ok) {
+        printf("FAIL %s: %s\n", test, what);
+        ++failures;
+    }
+    return ok;
+}
+
+// deterministic bytes that do not compress
+unsigned int randomBytes(char *buf, size_t len, unsigned int seed) {
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        buf[i] = seed;
+    }
+    return seed;
+}
+
+// compresses len bytes of src into the room lfs gives it, or into twice the
+// block when roomy, and checks that what comes back is src. Returns the
+// compressed length
+size_t roundTrip(const char *test, const char *what, const char *src, size_t len, bool roomy) {
+    static char packed[2 * CODEC_BLOCK + 64];
+    size_t capacity = (roomy) ? sizeof(packed) : len - len / 8;
+    size_t size = compressBlock(src, len, packed, capacity);
+    if (size == 0) {
+        check(!roomy, test, what);
+        return 0;
+    }
+    // exactly len bytes, so that a write past them trips the sanitizer
+    char *back = malloc(len + 1);
+    check(size < capacity, test, what);
+    check(decompressBlock(packed, size, back, len) == (int) len && memcmp(back, src, len) == 0, test, what);
+    free(back);
+    return size;
+}
+
+// the block codec gives back what it was given, also at the boundaries of
+// its length extensions, and refuses input that reaches outside the block
+void codecRoundTrips() {
+    const char *test = "codec_round_trips";
+    static char buf[CODEC_BLOCK], out[CODEC_BLOCK];
+    int before = failures;
+    size_t i, len;
+
+    randomBytes(buf, sizeof(buf), 1);
+    check(compressBlock(buf, sizeof(buf), out, sizeof(buf) - sizeof(buf) / 8) == 0, test, "random block compressed");
+    roundTrip(test, "incompressible", buf, sizeof(buf), true);
+
+    // a single match as long as the block allows
+    memset(buf, 0, sizeof(buf));
+    len = roundTrip(test, "all zeroes", buf, sizeof(buf), false);
+    check(len > 0 && len < 64, test, "all zeroes do not compress");
+    check(decompressBlock(out, 0, out, sizeof(out)) == 0, test, "empty input");
+
+    // inputs too short to hold a match are all literals
+    for (len = 0; len <= 16; ++len) {
+        randomBytes(buf, len, 2);
+        roundTrip(test, "short input", buf, len, true);
+    }
+    // every number of final literals after a long match, across the 15
+    // and 15 + 255 extension boundaries
+    for (len = 0; len < 300; ++len) {
+        memset(buf, 'z', sizeof(buf));
+        randomBytes(buf + sizeof(buf) - len, len, 3);
+        roundTrip(test, "final literals", buf, sizeof(buf), false);
+    }
+    // every match length, repeating a random prefix at its end
+    for (len = 4; 2 * len + 16 <= sizeof(buf); ++len) {
+        randomBytes(buf, sizeof(buf), 4);
+        memcpy(buf + sizeof(buf) - len - 16, buf, len);
+        roundTrip(test, "match length", buf, sizeof(buf), true);
+    }
+    // the longest offset the block has
+    randomBytes(buf, sizeof(buf), 5);
+    memcpy(buf + sizeof(buf) - 64, buf, 48);
+    roundTrip(test, "longest offset", buf, sizeof(buf), true);
+
+    // 1 literal then a match 2 back, before the start of the output
+    const char early[] = { 0x10, 'a', 2, 0 };
+    check(decompressBlock(early, sizeof(early), out, sizeof(out)) == -EIO, test, "offset before the output");
+    const char zero[] = { 0x10, 'a', 0, 0 };
+    check(decompressBlock(zero, sizeof(zero), out, sizeof(out)) == -EIO, test, "offset 0");
+    // a match of 4 + 15 + 255 * 16 + 1 bytes, past the end of the block
+    char longer[4 + 17];
+    longer[0] = 0x1f;
+    longer[1] = 'a';
+    longer[2] = 1;
+    longer[3] = 0;
+    memset(longer + 4, 255, 16);
+    longer[20] = 1;
+    check(decompressBlock(longer, sizeof(longer), out, sizeof(out)) == -EIO, test, "match past the block");
+    // 5 literals into room for 4
+    const char literals[] = { 0x50, 'a', 'b', 'c', 'd', 'e' };
+    check(decompressBlock(literals, sizeof(literals), out, 4) == -EIO, test, "literals past the block");
+    // more literals than the input holds, and lengths and offsets cut off
+    const char missing[] = { 0x50, 'a', 'b' };
+    check(decompressBlock(missing, sizeof(missing), out, sizeof(out)) == -EIO, test, "literals past the input");
+    const char extension[] = { 0xf0, 255 };
+    check(decompressBlock(extension, sizeof(extension), out, sizeof(out)) == -EIO, test, "length cut off");
+    const char offset[] = { 0x10, 'a', 1 };
+    check(decompressBlock(offset, sizeof(offset), out, sizeof(out)) == -EIO, test, "offset cut off");
+
+    // whatever the input, nothing lands outside the block
+    unsigned int seed = 6;
+    for (i = 0; i < CODEC_FUZZ && failures == before; ++i) {
+        len = 1 + seed % 64;
+        seed = randomBytes(buf, len, seed);
+        if (i % 2) { buf[0] = 0x10 | (buf[0] & 15); }
+        char *back = malloc(256);
+        int res = decompressBlock(buf, len, back, 256);
+        check(res == -EIO || (res >= 0 && res <= 256), test, "malformed input accepted past the block");
+        free(back);
+    }
+    if (failures == before) { printf("ok %s\n", test); }
+}
+
+// a file unlinked while open and then truncated and touched through its
+// descriptor keeps working, and nothing of it is back after a remount
+void unlinkThenFtruncate() {
+    const char *test = "unlink_then_ftruncate";
+    char path[PATH_LEN + 16], buf[12000], back[12000];
+    size_t i;
+    for (i = 0; i < sizeof(buf); ++i) { buf[i] = 'a' + i % 26; }
+    freshImage();
+    mountLfs(NULL);
+    snprintf(path, sizeof(path), "%s/f", mnt);
+    int fd = open(path, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) { fail("open", path); }
+    bool ok = check(pwrite(fd, buf, sizeof(buf), 0) == (ssize_t) sizeof(buf), test, "write");
+    ok = ok && check(fsync(fd) == 0, test, "fsync");
+    ok = ok && check(unlink(path) == 0, test, "unlink");
+    // 5000 ends inside the second block, which then needs its tail zeroed
+    ok = ok && check(ftruncate(fd, 5000) == 0, test, "ftruncate");
+    ok = ok && check(futimens(fd, NULL) == 0, test, "futimens");
+    ok = ok && check(ftruncate(fd, 9000) == 0, test, "ftruncate to grow");
+    struct stat st;
+    ok = ok && check(fstat(fd, &st) == 0 && st.st_size == 9000, test, "size after ftruncate");
+    ok = ok && check(pread(fd, back, sizeof(back), 0) == 9000, test, "read");
+    ok = ok && check(memcmp(back, buf, 5000) == 0, test, "data before the cut");
+    for (i = 5000; ok && i < 9000; ++i) { ok = check(back[i] == 0, test, "zeroes past the cut"); }
+    close(fd);
+    unmountLfs();
+    mountLfs(NULL);
+    ok = ok && check(stat(path, &st) != 0 && errno == ENOENT, test, "file back after remount");
+    unmountLfs();
+    if (ok) { printf("ok %s\n", test); }
+}
+
+// removing entries while a directory is read, including the one just
+// returned, neither skips nor repeats the rest
+void readdirWhileUnlinking() {
+    const char *test = "readdir_while_unlinking";
+    char path[PATH_LEN + 32];
+    static char seen[DIR_ENTRIES];
+    int i;
+    memset(seen, 0, sizeof(seen));
+    freshImage();
+    mountLfs(NULL);
+    snprintf(path, sizeof(path), "%s/d", mnt);
+    if (mkdir(path, 0755) != 0) { fail("mkdir", path); }
+    for (i = 0; i < DIR_ENTRIES; ++i) {
+        snprintf(path, sizeof(path), "%s/d/%d", mnt, i);
+        int fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if (fd < 0) { fail("open", path); }
+        close(fd);
+    }
+    snprintf(path, sizeof(path), "%s/d", mnt);
+    DIR *dir = opendir(path);
+    if (!dir) { fail("opendir", path); }
+    bool ok = true;
+    struct dirent *dirent;
+    while (ok && (dirent = readdir(dir)) != NULL) {
+        if (dirent->d_name[0] == '.') { continue; }
+        i = atoi(dirent->d_name);
+        ok = check(i >= 0 && i < DIR_ENTRIES && !seen[i]++, test, "name repeated or unknown");
+        snprintf(path, sizeof(path), "%s/d/%d", mnt, i);
+        if (ok && i % 2) { ok = check(unlink(path) == 0, test, "unlink"); }
+    }
+    closedir(dir);
+    for (i = 0; ok && i < DIR_ENTRIES; ++i) { ok = check(seen[i], test, "name skipped"); }
+    unmountLfs();
+    if (ok) { printf("ok %s\n", test); }
+}
+
+void fillPattern(char *buf, size_t len, int seed) {
+    size_t i;
+    for (i = 0; i < len; ++i) { buf[i] = 'a' + (i + seed) % 26; }
+}
+
+// writes len bytes of buf to a new file and syncs it
+bool writeFile(const char *path, const char *buf, size_t len) {
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) { return false; }
+    bool ok = write(fd, buf, len) == (ssize_t) len && fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// a file unlinked while open still reads its own data once the cleaner has
+// handed the segments it was mounted from to other files
+void unlinkedSurvivesCleaning() {
+    const char *test = "unlinked_survives_cleaning";
+    static char data[256 * 1024], back[256 * 1024], fill[1 << 20];
+    char path[PATH_LEN + 16], other[PATH_LEN + 16];
+    fillPattern(data, sizeof(data), 0);
+    memset(fill, 'B', sizeof(fill));
+    freshImage();
+    mountLfs(NULL);
+    snprintf(path, sizeof(path), "%s/f", mnt);
+    snprintf(other, sizeof(other), "%s/g", mnt);
+    if (!writeFile(path, data, sizeof(data))) { fail("write", path); }
+    unmountLfs();
+    // mounted lazily, the file's blocks are only addresses in the image
+    mountLfs("clean_low=1000,clean_high=1000,checkpoint_interval=1");
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { fail("open", path); }
+    bool ok = check(unlink(path) == 0, test, "unlink");
+    int round;
+    for (round = 0; ok && round < 40; ++round) {
+        ok = check(writeFile(other, fill, sizeof(fill)) && unlink(other) == 0, test, "refill");
+        usleep(100000);
+    }
+    ok = ok && check(pread(fd, back, sizeof(back), 0) == (ssize_t) sizeof(back), test, "read");
+    ok = ok && check(memcmp(back, data, sizeof(data)) == 0, test, "data of the unlinked file");
+    close(fd);
+    unmountLfs();
+    if (ok) { printf("ok %s\n", test); }
+}
+
+// the value of one line of the user.lfs.stats xattr on the root, -1 if
+// it is missing
+long lfsStat(const char *name) {
+    char stats[8192], key[128];
+    ssize_t len = getxattr(mnt, "user.lfs.stats", stats, sizeof(stats) - 1);
+    if (len < 0) { return -1; }
+    stats[len] = '\0';
+    snprintf(key, sizeof(key), "%s ", name);
+    char *line = stats;
+    while (line && *line) {
+        if (strncmp(line, key, strlen(key)) == 0) { return atol(line + strlen(key)); }
+        line = strchr(line, '\n');
+        if (line) { ++line; }
+    }
+    return -1;
+}
+
+// true when path holds exactly len bytes of buf
+bool sameFile(const char *path, const char *buf, size_t len) {
+    char *back = malloc(len + 1);
+    int fd = open(path, O_RDONLY);
+    bool same = fd >= 0 && back && read(fd, back, len + 1) == (ssize_t) len && memcmp(back, buf, len) == 0;
+    if (fd >= 0) { close(fd); }
+    free(back);
+    return same;
+}
+
+// writes and removes CHURN_ROUNDS files of random data so that, mounted
+// with clean_low and clean_high high, the cleaner moves whatever is left
+// live. Returns whether every round went through and the image stayed
+// smaller than what went through it, which it only does when cleaned
+bool churn(const char *test) {
+    static char fill[1 << 20];
+    char path[PATH_LEN + 16], image[PATH_LEN + 16];
+    snprintf(path, sizeof(path), "%s/churn", mnt);
+    snprintf(image, sizeof(image), "%s/disk.img", tmpdir);
+    int round;
+    for (round = 0; round < CHURN_ROUNDS; ++round) {
+        randomBytes(fill, sizeof(fill), round + 1);
+        if (!check(writeFile(path, fill, sizeof(fill)) && unlink(path) == 0, test, "churn")) { return false; }
+        usleep(100000);
+    }
+    struct stat st;
+    return check(stat(image, &st) == 0 && st.st_size < CHURN_ROUNDS / 2 * (off_t) sizeof(fill), test, "image not cleaned");
+}
+
+// blocks shared by two files are stored once and counted per file, through
+// an unlink, the cleaner moving them and a remount. The low-level backend
+// frees an unlinked file once the kernel forgets it, so counts after an
+// unlink are taken on a fresh mount
+void dedupRefcounts() {
+    const char *test = "dedup_refcounts";
+    static char data[8 * BLOCK];
+    char a[PATH_LEN + 16], b[PATH_LEN + 16];
+    int i;
+    for (i = 0; i < 8; ++i) { randomBytes(data + i * BLOCK, BLOCK, 100 + i); }
+    freshImage();
+    const char *opts = "dedup,clean_low=1000,clean_high=1000,checkpoint_interval=1";
+    mountLfs(opts);
+    snprintf(a, sizeof(a), "%s/a", mnt);
+    snprintf(b, sizeof(b), "%s/b", mnt);
+    bool ok = check(writeFile(a, data, sizeof(data)) && writeFile(b, data, sizeof(data)), test, "write");
+    ok = ok && check(lfsStat("dedup_blocks") == 8 && lfsStat("dedup_references") == 16, test, "8 blocks, 16 references after writing both");
+    ok = ok && check(unlink(a) == 0, test, "unlink");
+    unmountLfs();
+    mountLfs(opts);
+    ok = ok && check(lfsStat("dedup_blocks") == 8 && lfsStat("dedup_references") == 8, test, "8 blocks, 8 references after unlinking one");
+    ok = ok && churn(test);
+    ok = ok && check(lfsStat("dedup_blocks") == 8 && lfsStat("dedup_references") == 8, test, "8 blocks, 8 references after cleaning");
+    ok = ok && check(sameFile(b, data, sizeof(data)), test, "data after cleaning");
+    unmountLfs();
+    mountLfs(opts);
+    ok = ok && check(lfsStat("dedup_blocks") == 8 && lfsStat("dedup_references") == 8, test, "8 blocks, 8 references after a remount");
+    ok = ok && check(sameFile(b, data, sizeof(data)), test, "data after a remount");
+    ok = ok && check(unlink(b) == 0, test, "unlink");
+    unmountLfs();
+    mountLfs(opts);
+    ok = ok && check(lfsStat("dedup_blocks") == 0 && lfsStat("dedup_references") == 0, test, "blocks left after unlinking both");
+    unmountLfs();
+    if (ok) { printf("ok %s\n", test); }
+}
+
+// the size of the server's log, to look only at what a mount adds to it
+off_t logSize() {
+    char path[PATH_LEN + 16];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/lfs.log", tmpdir);
+    return (stat(path, &st) == 0) ? st.st_size : 0;
+}
+
+// whether the server logged text past from
+bool logMentions(const char *text, off_t from) {
+    char path[PATH_LEN + 16], line[1024];
+    snprintf(path, sizeof(path), "%s/lfs.log", tmpdir);
+    FILE *log = fopen(path, "r");
+    if (!log) { return false; }
+    bool found = false;
+    if (fseeko(log, from, SEEK_SET) == 0) {
+        while (!found && fgets(line, sizeof(line), log)) { found = strstr(line, text) != NULL; }
+    }
+    fclose(log);
+    return found;
+}
+
+// a crash after a checkpoint keeps what the checkpoint holds and what was
+// synced after it, which the mount rolls forward from the log
+void checkpointRollForward() {
+    const char *test = "checkpoint_roll_forward";
+    static char first[5 * BLOCK + 100], second[3 * BLOCK], patch[BLOCK];
+    char f[PATH_LEN + 16], g[PATH_LEN + 16], d[PATH_LEN + 16], moved[PATH_LEN + 16];
+    randomBytes(first, sizeof(first), 200);
+    randomBytes(second, sizeof(second), 201);
+    randomBytes(patch, sizeof(patch), 202);
+    freshImage();
+    const char *opts = "checkpoint_interval=1";
+    mountLfs(opts);
+    snprintf(f, sizeof(f), "%s/f", mnt);
+    snprintf(g, sizeof(g), "%s/g", mnt);
+    snprintf(d, sizeof(d), "%s/d", mnt);
+    snprintf(moved, sizeof(moved), "%s/d/f", mnt);
+    bool ok = check(mkdir(d, 0755) == 0, test, "mkdir");
+    ok = ok && check(writeFile(f, first, sizeof(first)), test, "write before the checkpoint");
+    // the cleaner thread writes one within a second of it being due
+    sleep(3);
+    // after it, a block of f changes, f moves and g is new
+    int fd = open(f, O_WRONLY);
+    ok = ok && check(fd >= 0 && pwrite(fd, patch, sizeof(patch), 2 * BLOCK) == (ssize_t) sizeof(patch), test, "overwrite");
+    if (fd >= 0) { close(fd); }
+    memcpy(first + 2 * BLOCK, patch, sizeof(patch));
+    ok = ok && check(rename(f, moved) == 0, test, "rename");
+    // syncing g commits everything before it
+    ok = ok && check(writeFile(g, second, sizeof(second)), test, "write after the checkpoint");
+    crashLfs();
+    off_t from = logSize();
+    mountLfs(opts);
+    ok = ok && check(!logMentions("Checkpoint unreadable", from), test, "checkpoint not used");
+    ok = ok && check(sameFile(moved, first, sizeof(first)), test, "file from the checkpoint");
+    struct stat st;
+    ok = ok && check(stat(f, &st) != 0 && errno == ENOENT, test, "rename undone");
+    ok = ok && check(sameFile(g, second, sizeof(second)), test, "file rolled forward");
+    // what was rolled forward stays after a clean unmount
+    unmountLfs();
+    mountLfs(opts);
+    ok = ok && check(sameFile(moved, first, sizeof(first)) && sameFile(g, second, sizeof(second)), test, "files after a second mount");
+    unmountLfs();
+    if (ok) { printf("ok %s\n", test); }
+}
+
+// writes len bytes of buf to a new file without syncing it
+bool writeUnsynced(const char *path, const char *buf, size_t len) {
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) { return false; }
+    bool ok = write(fd, buf, len) == (ssize_t) len;
+    close(fd);
+    return ok;
+}
+
+// changes a tree without syncing anything, crashes either at once on a
+// durable mount or after a commit interval otherwise, and checks that every
+// change reached the image
+void commitSurvivesCrash(const char *test, const char *opts, useconds_t wait) {
+    static char data[4 * BLOCK + 10], patch[100];
+    char d[PATH_LEN + 16], f[PATH_LEN + 16], g[PATH_LEN + 16], h[PATH_LEN + 16];
+    randomBytes(data, sizeof(data), 300);
+    randomBytes(patch, sizeof(patch), 301);
+    freshImage();
+    mountLfs(opts);
+    snprintf(d, sizeof(d), "%s/d", mnt);
+    snprintf(f, sizeof(f), "%s/d/f", mnt);
+    snprintf(g, sizeof(g), "%s/g", mnt);
+    snprintf(h, sizeof(h), "%s/h", mnt);
+    bool ok = check(mkdir(d, 0755) == 0, test, "mkdir");
+    ok = ok && check(writeUnsynced(f, data, sizeof(data)), test, "write");
+    ok = ok && check(writeUnsynced(g, data, sizeof(data)) && writeUnsynced(h, data, sizeof(data)), test, "write");
+    ok = ok && check(unlink(h) == 0, test, "unlink");
+    ok = ok && check(truncate(g, BLOCK + 1) == 0, test, "truncate");
+    int fd = open(f, O_WRONLY);
+    ok = ok && check(fd >= 0 && pwrite(fd, patch, sizeof(patch), BLOCK - 50) == (ssize_t) sizeof(patch), test, "overwrite");
+    if (fd >= 0) { close(fd); }
+    memcpy(data + BLOCK - 50, patch, sizeof(patch));
+    usleep(wait);
+    crashLfs();
+    mountLfs(opts);
+    struct stat st;
+    ok = ok && check(sameFile(f, data, sizeof(data)), test, "written file");
+    ok = ok && check(stat(g, &st) == 0 && st.st_size == BLOCK + 1, test, "truncated size");
+    ok = ok && check(stat(h, &st) != 0 && errno == ENOENT, test, "unlinked file back");
+    unmountLfs();
+    if (ok) { printf("ok %s\n", test); }
+}
+
+// the contents of a worker's round: up to 6 blocks, deterministic
+size_t stressData(char *buf, int worker, int round) {
+    size_t len = (round * 7919 + worker * 104729) % (6 * BLOCK) + 1;
+    randomBytes(buf, len, 1000 * worker + round + 1);
+    return len;
+}
+
+// one process of the stress test. In a directory of its own it writes and
+// syncs tmp, renames it to done<round>, reads it back and removes every
+// other one, so a done file is always complete. Meanwhile it reads a common
+// file and races the other workers creating, removing and listing the same
+// names in a shared directory. Returns 0, or 1 on the first unexpected
+// result
+int stressWorker(int worker) {
+    static char buf[6 * BLOCK], common[6 * BLOCK], back[BLOCK];
+    char own[PATH_LEN + 32], tmp[PATH_LEN + 64], done[PATH_LEN + 64], path[PATH_LEN + 64];
+    snprintf(own, sizeof(own), "%s/w%d", mnt, worker);
+    snprintf(tmp, sizeof(tmp), "%s/tmp", own);
+    if (mkdir(own, 0755) != 0) { return 1; }
+    randomBytes(common, sizeof(common), 999);
+    snprintf(path, sizeof(path), "%s/common", mnt);
+    int shared = open(path, O_RDONLY);
+    if (shared < 0) { return 1; }
+    int round;
+    for (round = 0; round < STRESS_ROUNDS; ++round) {
+        size_t len = stressData(buf, worker, round);
+        snprintf(done, sizeof(done), "%s/done%d", own, round);
+        if (!writeFile(tmp, buf, len) || rename(tmp, done) != 0 || !sameFile(done, buf, len)) { return 1; }
+        if (round % 2) {
+            snprintf(path, sizeof(path), "%s/done%d", own, round - 1);
+            if (unlink(path) != 0) { return 1; }
+        }
+        off_t off = (round * 4099) % (sizeof(common) - sizeof(back));
+        if (pread(shared, back, sizeof(back), off) != (ssize_t) sizeof(back) || memcmp(back, common + off, sizeof(back)) != 0) { return 1; }
+        snprintf(path, sizeof(path), "%s/shared/%d", mnt, round % STRESS_NAMES);
+        // without a create callback the kernel makes the file and then opens
+        // it, and another worker's unlink can come in between
+        int fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if (fd < 0 && errno != ENOENT) { return 1; }
+        if (fd >= 0 && write(fd, buf, 100) != 100) { return 1; }
+        if (fd >= 0) { close(fd); }
+        snprintf(path, sizeof(path), "%s/shared/%d", mnt, (round + worker) % STRESS_NAMES);
+        if (unlink(path) != 0 && errno != ENOENT) { return 1; }
+        snprintf(path, sizeof(path), "%s/shared", mnt);
+        DIR *dir = opendir(path);
+        if (!dir) { return 1; }
+        struct dirent *dirent;
+        while ((dirent = readdir(dir)) != NULL) {
+            if (dirent->d_name[0] == '.') { continue; }
+            struct stat st;
+            int name = atoi(dirent->d_name);
+            snprintf(path, sizeof(path), "%s/shared/%d", mnt, name);
+            if (name >= STRESS_NAMES || (stat(path, &st) != 0 && errno != ENOENT)) {
+                closedir(dir);
+                return 1;
+            }
+        }
+        closedir(dir);
+    }
+    close(shared);
+    return 0;
+}
+
+// checks what the workers left: each done file there is complete and, when
+// finished, only the last of every pair is left
+bool stressLeft(const char *test, bool finished) {
+    static char buf[6 * BLOCK];
+    char path[PATH_LEN + 64];
+    int worker, round;
+    for (worker = 0; worker < STRESS_WORKERS; ++worker) {
+        for (round = 0; round < STRESS_ROUNDS; ++round) {
+            size_t len = stressData(buf, worker, round);
+            snprintf(path, sizeof(path), "%s/w%d/done%d", mnt, worker, round);
+            struct stat st;
+            bool there = stat(path, &st) == 0;
+            if (!check(there || errno == ENOENT, test, "stat") || (there && !check(sameFile(path, buf, len), test, "done file incomplete"))) { return false; }
+            if (finished && !check(there == (round % 2 || round == STRESS_ROUNDS - 1), test, "done file left or missing")) { return false; }
+        }
+    }
+    return true;
+}
+
+// STRESS_WORKERS processes work the multithreaded server at once with
+// dedup, compression, the cleaner and checkpoints all running. With crash,
+// the server is killed partway through and the image must still mount
+// with every completed file intact
+void stress(const char *test, bool crash) {
+    static char common[6 * BLOCK];
+    char path[PATH_LEN + 16];
+    pid_t workers[STRESS_WORKERS];
+    int i;
+    randomBytes(common, sizeof(common), 999);
+    freshImage();
+    const char *opts = "dedup,compress,clean_low=1000,clean_high=1000,checkpoint_interval=1";
+    mountLfs(opts);
+    snprintf(path, sizeof(path), "%s/shared", mnt);
+    if (mkdir(path, 0755) != 0) { fail("mkdir", path); }
+    snprintf(path, sizeof(path), "%s/common", mnt);
+    if (!writeFile(path, common, sizeof(common))) { fail("write", path); }
+    for (i = 0; i < STRESS_WORKERS; ++i) {
+        if ((workers[i] = fork()) == 0) { _exit(stressWorker(i)); }
+        if (workers[i] < 0) { fail("fork", binary); }
+    }
+    bool ok = true;
+    if (crash) {
+        sleep(2);
+        kill(server, SIGKILL);
+    }
+    for (i = 0; i < STRESS_WORKERS; ++i) {
+        int status;
+        // after a crash the workers only see errors, and must not go on in
+        // the directory below the mount
+        if (crash) { kill(workers[i], SIGKILL); }
+        waitpid(workers[i], &status, 0);
+        if (!crash) { ok = ok && check(WIFEXITED(status) && WEXITSTATUS(status) == 0, test, "worker"); }
+    }
+    if (crash) { crashLfs(); }
+    else { ok = ok && stressLeft(test, true); }
+    unmountLfs();
+    mountLfs(opts);
+    ok = ok && stressLeft(test, !crash);
+    ok = ok && check(sameFile(path, common, sizeof(common)), test, "common file");
+    unmountLfs();
+    if (ok) { printf("ok %s\n", test); }
+}
+
+// whether a file's user.lfs.extents xattr reads expect and its st_blocks
+// comes to the given number of 4 KiB blocks
+bool sparseAs(const char *path, const char *expect, long blocks) {
+    char extents[1024];
+    struct stat st;
+    ssize_t len = getxattr(path, "user.lfs.extents", extents, sizeof(extents) - 1);
+    if (len < 0 || stat(path, &st) != 0) { return false; }
+    extents[len] = '\0';
+    return strcmp(extents, expect) == 0 && st.st_blocks == blocks * (BLOCK / 512);
+}
+
+// holes take no blocks and read as zeroes: left by writing past the end,
+// punched with fallocate, and kept by a remount; extents list the rest
+void sparseFiles() {
+    const char *test = "sparse_files";
+    static char expect[SPARSE_BLOCKS * BLOCK], data[SPARSE_BLOCKS * BLOCK];
+    char path[PATH_LEN + 16];
+    memset(expect, 0, sizeof(expect));
+    randomBytes(expect, 4 * BLOCK, 400);
+    randomBytes(expect + 100 * BLOCK, BLOCK, 401);
+    freshImage();
+    mountLfs(NULL);
+    snprintf(path, sizeof(path), "%s/f", mnt);
+    int fd = open(path, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) { fail("open", path); }
+    bool ok = check(pwrite(fd, expect, 4 * BLOCK, 0) == 4 * BLOCK, test, "write");
+    ok = ok && check(pwrite(fd, expect + 100 * BLOCK, BLOCK, 100 * BLOCK) == BLOCK, test, "write past the end");
+    ok = ok && check(sparseAs(path, "0 16384\n409600 4096\n", 5), test, "extents after writing");
+    ok = ok && check(fallocate(fd, FALLOC_FL_PUNCH_HOLE, BLOCK, BLOCK) != 0 && errno == EOPNOTSUPP, test, "punch that changes the size");
+    // whole blocks become holes, a partial one is zeroed and stays
+    ok = ok && check(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, BLOCK, 2 * BLOCK) == 0, test, "punch");
+    ok = ok && check(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 3 * BLOCK + 100, 200) == 0, test, "punch within a block");
+    memset(expect + BLOCK, 0, 2 * BLOCK);
+    memset(expect + 3 * BLOCK + 100, 0, 200);
+    ok = ok && check(sparseAs(path, "0 4096\n12288 4096\n409600 4096\n", 3), test, "extents after punching");
+    // growing, by fallocate or truncate, adds no blocks
+    ok = ok && check(fallocate(fd, 0, 200 * BLOCK, BLOCK) == 0 && ftruncate(fd, 300 * BLOCK) == 0, test, "grow");
+    struct stat st;
+    ok = ok && check(fstat(fd, &st) == 0 && st.st_size == 300 * BLOCK, test, "size after growing");
+    ok = ok && check(sparseAs(path, "0 4096\n12288 4096\n409600 4096\n", 3), test, "extents after growing");
+    ok = ok && check(ftruncate(fd, sizeof(expect)) == 0, test, "truncate");
+    ok = ok && check(pread(fd, data, sizeof(data), 0) == sizeof(data) && memcmp(data, expect, sizeof(data)) == 0, test, "data");
+    close(fd);
+    unmountLfs();
+    mountLfs(NULL);
+    ok = ok && check(sparseAs(path, "0 4096\n12288 4096\n409600 4096\n", 3), test, "extents after a remount");
+    ok = ok && check(sameFile(path, expect, sizeof(expect)), test, "data after a remount");
+    // a cut inside a hole leaves only the blocks before it
+    ok = ok && check(truncate(path, 2 * BLOCK + 10) == 0, test, "truncate into a hole");
+    ok = ok && check(sparseAs(path, "0 4096\n", 1), test, "extents after truncating");
+    ok = ok && check(sameFile(path, expect, 2 * BLOCK + 10), test, "data after truncating");
+    unmountLfs();
+    if (ok) { printf("ok %s\n", test); }
+}
+
+// whether path names a file of size bytes, or is missing when size < 0
+bool statAs(const char *path, off_t size) {
+    struct stat st;
+    if (size < 0) { return stat(path, &st) != 0 && errno == ENOENT; }
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == size;
+}
+
+// the path backend caches lookups, misses included; creating, removing and
+// renaming files and directories must leave no stale entry in it. The
+// kernel's own cache is off so that every lookup reaches lfs
+void dcacheInvalidation() {
+    const char *test = "dcache_invalidation";
+    char d[PATH_LEN + 16], d2[PATH_LEN + 16], x[PATH_LEN + 16], y[PATH_LEN + 16];
+    char child[PATH_LEN + 16], moved[PATH_LEN + 16], later[PATH_LEN + 16];
+    freshImage();
+    mountLfs("cache_timeout=0");
+    snprintf(d, sizeof(d), "%s/d", mnt);
+    snprintf(d2, sizeof(d2), "%s/d2", mnt);
+    snprintf(x, sizeof(x), "%s/d/x", mnt);
+    snprintf(y, sizeof(y), "%s/y", mnt);
+    snprintf(child, sizeof(child), "%s/d/c", mnt);
+    snprintf(moved, sizeof(moved), "%s/d2/c", mnt);
+    snprintf(later, sizeof(later), "%s/d2/x", mnt);
+    // misses, twice so that the second comes from the cache
+    bool ok = check(statAs(x, -1) && statAs(x, -1), test, "missing file found");
+    ok = ok && check(mkdir(d, 0755) == 0 && statAs(x, -1), test, "mkdir");
+    ok = ok && check(writeFile(x, "abc", 3) && statAs(x, 3), test, "file created after a miss");
+    ok = ok && check(rename(x, y) == 0 && statAs(x, -1) && statAs(y, 3), test, "file renamed");
+    ok = ok && check(writeFile(x, "abcd", 4) && rename(x, y) == 0, test, "rename over a file");
+    ok = ok && check(statAs(x, -1) && statAs(y, 4), test, "file replaced");
+    ok = ok && check(unlink(y) == 0 && statAs(y, -1), test, "file unlinked");
+    ok = ok && check(writeFile(y, "a", 1) && statAs(y, 1), test, "file recreated");
+    // a directory takes its children, cached or missed, along
+    ok = ok && check(writeFile(child, "ab", 2) && statAs(child, 2) && statAs(moved, -1) && statAs(later, -1), test, "child");
+    ok = ok && check(rename(d, d2) == 0, test, "directory renamed");
+    ok = ok && check(statAs(child, -1) && statAs(moved, 2), test, "child after renaming its directory");
+    ok = ok && check(writeFile(later, "abcde", 5) && statAs(later, 5), test, "file created below a renamed directory");
+    ok = ok && check(mkdir(d, 0755) == 0 && statAs(child, -1), test, "old directory name reused");
+    ok = ok && check(unlink(moved) == 0 && unlink(later) == 0 && rmdir(d2) == 0 && statAs(moved, -1), test, "directory removed");
+    ok = ok && check(rename(d, d2) == 0 && statAs(moved, -1) && writeFile(moved, "abc", 3) && statAs(moved, 3), test, "directory renamed onto a removed one");
+    // counters move only on the path backend, which is the one with the cache
+    if (lfsStat("dcache_misses") > 0) {
+        ok = ok && check(lfsStat("dcache_negative_hits") > 0 && lfsStat("dcache_invalidations") > 0, test, "cache not used");
+    }
+    unmountLfs();
+    if (ok) { printf("ok %s\n", test); }
+}
+
+// a directory's size is that of everything below it. A write two levels
+// down changes it without the kernel seeing, which must notice within the
+// default attribute timeout: the low-level backend tells it, the path
+// backend's timeout is short
+void dirSizeFollowsWrites() {
+    const char *test = "dir_size_follows_writes";
+    static char data[10000];
+    char d[PATH_LEN + 16], e[PATH_LEN + 16], f[PATH_LEN + 16];
+    randomBytes(data, sizeof(data), 500);
+    freshImage();
+    mountLfs(NULL);
+    snprintf(d, sizeof(d), "%s/d", mnt);
+    snprintf(e, sizeof(e), "%s/d/e", mnt);
+    snprintf(f, sizeof(f), "%s/d/e/f", mnt);
+    struct stat before, after;
+    bool ok = check(mkdir(d, 0755) == 0 && mkdir(e, 0755) == 0 && writeFile(f, "", 0), test, "create");
+    ok = ok && check(stat(d, &before) == 0, test, "stat");
+    int fd = open(f, O_WRONLY);
+    ok = ok && check(fd >= 0 && write(fd, data, sizeof(data)) == (ssize_t) sizeof(data), test, "write");
+    if (fd >= 0) { close(fd); }
+    sleep(2);
+    ok = ok && check(stat(d, &after) == 0 && after.st_size == before.st_size + (off_t) sizeof(data), test, "size of the directory");
+    unmountLfs();
+    if (ok) { printf("ok %s\n", test); }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <lfs binary> [lfs options]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2 && argv[2][0]) { options = argv[2]; }
+    // lfs runs from the temporary directory, so a relative path would break
+    if (!(binary = realpath(argv[1], NULL))) { fail("realpath", argv[1]); }
+    const char *tmp = getenv("TMPDIR");
+    snprintf(tmpdir, sizeof(tmpdir), "%s/lfs-check.XXXXXX", (tmp) ? tmp : "/tmp");
+    if (!mkdtemp(tmpdir)) { fail("mkdtemp", tmpdir); }
+    snprintf(mnt, sizeof(mnt), "%s/mnt", tmpdir);
+    if (mkdir(mnt, 0755) != 0) { fail("mkdir", mnt); }
+
+    codecRoundTrips();
+    unlinkThenFtruncate();
+    readdirWhileUnlinking();
+    unlinkedSurvivesCleaning();
+    dedupRefcounts();
+    sparseFiles();
+    dcacheInvalidation();
+    dirSizeFollowsWrites();
+    checkpointRollForward();
+    commitSurvivesCrash("durable_survives_crash", "durable", 0);
+    // the flusher commits every 100 ms, so 1 s leaves it room to spare
+    commitSurvivesCrash("group_commit_survives_crash", "commit_interval=100", 1000000);
+    stress("stress", false);
+    stress("stress_crash", true);
+
+    // a failure leaves the image and the server's log behind
+    if (failures) {
+        fprintf(stderr, "see %s\n", tmpdir);
+        return 1;
+    }
+    char path[PATH_LEN + 16];
+    freshImage();
+    snprintf(path, sizeof(path), "%s/lfs.log", tmpdir);
+    unlink(path);
+    rmdir(mnt);
+    rmdir(tmpdir);
+    free(binary);
+    return 0;
+}